@@ -0,0 +1,197 @@
+#include "CompressorPipe.h"
+#include <string.h>
+#ifdef WIN32
+#include <windows.h>
+#include <vector>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#endif
+
+CCompressorPipe::CCompressorPipe(std::string command)
+#ifdef WIN32
+: process(0),
+  input(0),
+  output(0)
+{
+	SECURITY_ATTRIBUTES sa;
+	sa.nLength=sizeof(sa);
+	sa.lpSecurityDescriptor=0;
+	sa.bInheritHandle=TRUE;
+	HANDLE inRead,inWrite,outRead,outWrite;
+	if(!CreatePipe(&inRead,&inWrite,&sa,0))
+		return;
+	if(!CreatePipe(&outRead,&outWrite,&sa,0)){
+		CloseHandle(inRead);
+		CloseHandle(inWrite);
+		return;
+	}
+	//only the ends the compressor uses are inherited
+	SetHandleInformation(inWrite,HANDLE_FLAG_INHERIT,0);
+	SetHandleInformation(outRead,HANDLE_FLAG_INHERIT,0);
+
+	STARTUPINFOA si;
+	memset(&si,0,sizeof(si));
+	si.cb=sizeof(si);
+	si.dwFlags=STARTF_USESTDHANDLES;
+	si.hStdInput=inRead;
+	si.hStdOutput=outWrite;
+	si.hStdError=GetStdHandle(STD_ERROR_HANDLE);
+	PROCESS_INFORMATION pi;
+	std::vector<char> commandLine(command.begin(),command.end());
+	commandLine.push_back(0);
+	BOOL started=CreateProcessA(0,&commandLine[0],0,0,TRUE,0,0,0,&si,&pi);
+	CloseHandle(inRead);
+	CloseHandle(outWrite);
+	if(!started){
+		CloseHandle(inWrite);
+		CloseHandle(outRead);
+		return;
+	}
+	CloseHandle(pi.hThread);
+	process=pi.hProcess;
+	input=inWrite;
+	output=outRead;
+}
+#else
+: pid(-1),
+  input(-1),
+  output(-1)
+{
+	int in[2],out[2];
+	if(pipe(in)!=0)
+		return;
+	if(pipe(out)!=0){
+		close(in[0]);
+		close(in[1]);
+		return;
+	}
+	//the ends kept here mustnt leak into compressors started later, or those would hold
+	//this ones stdin open
+	fcntl(in[1],F_SETFD,FD_CLOEXEC);
+	fcntl(out[0],F_SETFD,FD_CLOEXEC);
+	//a compressor that quits early should fail the write instead of killing us
+	signal(SIGPIPE,SIG_IGN);
+	pid=fork();
+	if(pid==0){
+		dup2(in[0],0);
+		dup2(out[1],1);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		execl("/bin/sh","sh","-c",command.c_str(),(char*)0);
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	if(pid<0){
+		close(in[1]);
+		close(out[0]);
+		return;
+	}
+	input=in[1];
+	output=out[0];
+}
+#endif
+
+CCompressorPipe::~CCompressorPipe(void)
+{
+	Close();
+}
+
+bool CCompressorPipe::IsOpen()
+{
+#ifdef WIN32
+	return input!=0;
+#else
+	return input>=0;
+#endif
+}
+
+bool CCompressorPipe::Compress(const unsigned char* rgba,int xsize,int ysize,int numMipmaps,unsigned char* dst,int dstSize)
+{
+	if(!IsOpen())
+		return false;
+	int header[3]={xsize,ysize,numMipmaps};
+	int size=0;
+	if(!Write(header,sizeof(header)) || !Write(rgba,xsize*ysize*4) || !Read(&size,sizeof(size))
+			|| size!=dstSize || !Read(dst,dstSize)){
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool CCompressorPipe::Write(const void* buf,int size)
+{
+	const char* p=(const char*)buf;
+	while(size>0){
+#ifdef WIN32
+		DWORD written=0;
+		if(!WriteFile(input,p,size,&written,0) || written==0)
+			return false;
+#else
+		int written=(int)write(input,p,size);
+		if(written<0 && errno==EINTR)
+			continue;
+		if(written<=0)
+			return false;
+#endif
+		p+=written;
+		size-=written;
+	}
+	return true;
+}
+
+bool CCompressorPipe::Read(void* buf,int size)
+{
+	char* p=(char*)buf;
+	while(size>0){
+#ifdef WIN32
+		DWORD got=0;
+		if(!ReadFile(output,p,size,&got,0) || got==0)
+			return false;
+#else
+		int got=(int)read(output,p,size);
+		if(got<0 && errno==EINTR)
+			continue;
+		if(got<=0)
+			return false;
+#endif
+		p+=got;
+		size-=got;
+	}
+	return true;
+}
+
+void CCompressorPipe::Close()
+{
+	//closing its stdin tells the compressor to quit
+#ifdef WIN32
+	if(input)
+		CloseHandle(input);
+	if(output)
+		CloseHandle(output);
+	if(process){
+		WaitForSingleObject(process,INFINITE);
+		CloseHandle(process);
+	}
+	process=0;
+	input=0;
+	output=0;
+#else
+	if(input>=0)
+		close(input);
+	if(output>=0)
+		close(output);
+	if(pid>0)
+		waitpid(pid,0,0);
+	pid=-1;
+	input=-1;
+	output=-1;
+#endif
+}
@@ -0,0 +1,37 @@
+#ifndef __COMPRESSOR_PIPE_H__
+#define __COMPRESSOR_PIPE_H__
+
+#include <string>
+
+//an external compressor that speaks the stream protocol, kept running for several images
+//each request on its stdin is three ints, xsize, ysize and the number of mipmaps, followed by
+//the rgba pixels, it answers on stdout with the size of the dxt1 data as an int and then the
+//data, all ints in native byte order, closing its stdin ends it
+class CCompressorPipe
+{
+public:
+	CCompressorPipe(std::string command);
+	~CCompressorPipe(void);
+
+	bool IsOpen();
+	//false if the compressor failed or sent anything but dstSize bytes, it is closed then
+	bool Compress(const unsigned char* rgba,int xsize,int ysize,int numMipmaps,unsigned char* dst,int dstSize);
+private:
+	CCompressorPipe(const CCompressorPipe&);
+	CCompressorPipe& operator=(const CCompressorPipe&);
+
+	bool Write(const void* buf,int size);
+	bool Read(void* buf,int size);
+	void Close();
+#ifdef WIN32
+	void* process;
+	void* input;		//the compressors stdin
+	void* output;		//and stdout
+#else
+	int pid;
+	int input;
+	int output;
+#endif
+};
+
+#endif // __COMPRESSOR_PIPE_H__
@@ -0,0 +1,600 @@
+#include "DxtCompressor.h"
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <assert.h>
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#define DXT_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#define DXT_AVX2
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+//the pixels of a block, blocks at the edge of the small mipmaps repeat their last row and column
+struct DxtBlock
+{
+	short r[16];
+	short g[16];
+	short b[16];
+};
+
+//an encoding of a block and its squared error
+struct DxtEncoding
+{
+	int c0;
+	int c1;
+	int indices[16];
+	int error;
+};
+
+static int Pack565(float r,float g,float b)
+{
+	int r5=max(0,min(31,(int)(r*31/255+0.5f)));
+	int g6=max(0,min(63,(int)(g*63/255+0.5f)));
+	int b5=max(0,min(31,(int)(b*31/255+0.5f)));
+	return (r5<<11)|(g6<<5)|b5;
+}
+
+static void Unpack565(int c,int& r,int& g,int& b)
+{
+	r=(c>>11)&31;
+	g=(c>>5)&63;
+	b=c&31;
+	r=(r<<3)|(r>>2);
+	g=(g<<2)|(g>>4);
+	b=(b<<3)|(b>>2);
+}
+
+//the colour on the 565 grid closest to v
+static float SnapToGrid(float v,int steps)
+{
+	v=max(0.0f,min(255.0f,v));
+	return floor(v*steps/255+0.5f)*255/steps;
+}
+
+//the four colours of a block with c0>c1, equal endpoints only use index 0
+static void MakePalette(int c0,int c1,int* pr,int* pg,int* pb)
+{
+	Unpack565(c0,pr[0],pg[0],pb[0]);
+	Unpack565(c1,pr[1],pg[1],pb[1]);
+	if(c0>c1){
+		pr[2]=(2*pr[0]+pr[1]+1)/3;
+		pg[2]=(2*pg[0]+pg[1]+1)/3;
+		pb[2]=(2*pb[0]+pb[1]+1)/3;
+		pr[3]=(pr[0]+2*pr[1]+1)/3;
+		pg[3]=(pg[0]+2*pg[1]+1)/3;
+		pb[3]=(pb[0]+2*pb[1]+1)/3;
+	} else {
+		pr[2]=pr[3]=pr[0];
+		pg[2]=pg[3]=pg[0];
+		pb[2]=pb[3]=pb[0];
+	}
+}
+
+//plain versions, the simd ones below must give exactly the same results
+#if !defined(DXT_SSE2) || defined(_DEBUG)
+static int FitIndicesRef(const DxtBlock& bl,const int* pr,const int* pg,const int* pb,int* indices)
+{
+	int error=0;
+	for(int i=0;i<16;++i){
+		int best=INT_MAX;
+		for(int k=0;k<4;++k){
+			int dr=bl.r[i]-pr[k];
+			int dg=bl.g[i]-pg[k];
+			int db=bl.b[i]-pb[k];
+			int d=dr*dr+dg*dg+db*db;
+			if(d<best){
+				best=d;
+				indices[i]=k;
+			}
+		}
+		error+=best;
+	}
+	return error;
+}
+
+static void ColorRangeRef(const DxtBlock& bl,int* lo,int* hi)
+{
+	lo[0]=hi[0]=bl.r[0];
+	lo[1]=hi[1]=bl.g[0];
+	lo[2]=hi[2]=bl.b[0];
+	for(int i=1;i<16;++i){
+		lo[0]=min(lo[0],(int)bl.r[i]);
+		lo[1]=min(lo[1],(int)bl.g[i]);
+		lo[2]=min(lo[2],(int)bl.b[i]);
+		hi[0]=max(hi[0],(int)bl.r[i]);
+		hi[1]=max(hi[1],(int)bl.g[i]);
+		hi[2]=max(hi[2],(int)bl.b[i]);
+	}
+}
+#endif
+
+#if defined(DXT_SSE2) && !defined(DXT_AVX2)
+static int FitIndicesSSE2(const DxtBlock& bl,const int* pr,const int* pg,const int* pb,int* indices)
+{
+	__m128i zero=_mm_setzero_si128();
+	__m128i errors=zero;
+	for(int h=0;h<16;h+=8){
+		__m128i r=_mm_loadu_si128((const __m128i*)&bl.r[h]);
+		__m128i g=_mm_loadu_si128((const __m128i*)&bl.g[h]);
+		__m128i b=_mm_loadu_si128((const __m128i*)&bl.b[h]);
+		__m128i bestLo=zero,bestHi=zero,indexLo=zero,indexHi=zero;
+		for(int k=0;k<4;++k){
+			__m128i dr=_mm_sub_epi16(r,_mm_set1_epi16((short)pr[k]));
+			__m128i dg=_mm_sub_epi16(g,_mm_set1_epi16((short)pg[k]));
+			__m128i db=_mm_sub_epi16(b,_mm_set1_epi16((short)pb[k]));
+			//pairs of 16 bit differences give dr*dr+dg*dg and db*db per pixel with madd
+			__m128i rgLo=_mm_unpacklo_epi16(dr,dg);
+			__m128i rgHi=_mm_unpackhi_epi16(dr,dg);
+			__m128i bLo=_mm_unpacklo_epi16(db,zero);
+			__m128i bHi=_mm_unpackhi_epi16(db,zero);
+			__m128i dLo=_mm_add_epi32(_mm_madd_epi16(rgLo,rgLo),_mm_madd_epi16(bLo,bLo));
+			__m128i dHi=_mm_add_epi32(_mm_madd_epi16(rgHi,rgHi),_mm_madd_epi16(bHi,bHi));
+			if(k==0){
+				bestLo=dLo;
+				bestHi=dHi;
+				continue;
+			}
+			__m128i kk=_mm_set1_epi32(k);
+			__m128i mLo=_mm_cmplt_epi32(dLo,bestLo);
+			__m128i mHi=_mm_cmplt_epi32(dHi,bestHi);
+			bestLo=_mm_or_si128(_mm_and_si128(mLo,dLo),_mm_andnot_si128(mLo,bestLo));
+			bestHi=_mm_or_si128(_mm_and_si128(mHi,dHi),_mm_andnot_si128(mHi,bestHi));
+			indexLo=_mm_or_si128(_mm_and_si128(mLo,kk),_mm_andnot_si128(mLo,indexLo));
+			indexHi=_mm_or_si128(_mm_and_si128(mHi,kk),_mm_andnot_si128(mHi,indexHi));
+		}
+		_mm_storeu_si128((__m128i*)&indices[h],indexLo);
+		_mm_storeu_si128((__m128i*)&indices[h+4],indexHi);
+		errors=_mm_add_epi32(errors,_mm_add_epi32(bestLo,bestHi));
+	}
+	errors=_mm_add_epi32(errors,_mm_srli_si128(errors,8));
+	errors=_mm_add_epi32(errors,_mm_srli_si128(errors,4));
+	return _mm_cvtsi128_si32(errors);
+}
+#endif
+
+#ifdef DXT_SSE2
+static int HorizontalMin(__m128i v)
+{
+	v=_mm_min_epi16(v,_mm_srli_si128(v,8));
+	v=_mm_min_epi16(v,_mm_srli_si128(v,4));
+	v=_mm_min_epi16(v,_mm_srli_si128(v,2));
+	return (short)_mm_cvtsi128_si32(v);
+}
+
+static int HorizontalMax(__m128i v)
+{
+	v=_mm_max_epi16(v,_mm_srli_si128(v,8));
+	v=_mm_max_epi16(v,_mm_srli_si128(v,4));
+	v=_mm_max_epi16(v,_mm_srli_si128(v,2));
+	return (short)_mm_cvtsi128_si32(v);
+}
+
+static void ColorRangeSSE2(const DxtBlock& bl,int* lo,int* hi)
+{
+	const short* channels[3]={bl.r,bl.g,bl.b};
+	for(int c=0;c<3;++c){
+		__m128i a=_mm_loadu_si128((const __m128i*)channels[c]);
+		__m128i b=_mm_loadu_si128((const __m128i*)(channels[c]+8));
+		lo[c]=HorizontalMin(_mm_min_epi16(a,b));
+		hi[c]=HorizontalMax(_mm_max_epi16(a,b));
+	}
+}
+#endif
+
+#ifdef DXT_AVX2
+static int FitIndicesAVX2(const DxtBlock& bl,const int* pr,const int* pg,const int* pb,int* indices)
+{
+	__m256i errors=_mm256_setzero_si256();
+	for(int h=0;h<16;h+=8){
+		__m256i r=_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)&bl.r[h]));
+		__m256i g=_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)&bl.g[h]));
+		__m256i b=_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)&bl.b[h]));
+		__m256i best=_mm256_set1_epi32(INT_MAX);
+		__m256i index=_mm256_setzero_si256();
+		for(int k=0;k<4;++k){
+			__m256i dr=_mm256_sub_epi32(r,_mm256_set1_epi32(pr[k]));
+			__m256i dg=_mm256_sub_epi32(g,_mm256_set1_epi32(pg[k]));
+			__m256i db=_mm256_sub_epi32(b,_mm256_set1_epi32(pb[k]));
+			__m256i d=_mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dr,dr),_mm256_mullo_epi32(dg,dg)),_mm256_mullo_epi32(db,db));
+			__m256i m=_mm256_cmpgt_epi32(best,d);
+			best=_mm256_blendv_epi8(best,d,m);
+			index=_mm256_blendv_epi8(index,_mm256_set1_epi32(k),m);
+		}
+		_mm256_storeu_si256((__m256i*)&indices[h],index);
+		errors=_mm256_add_epi32(errors,best);
+	}
+	__m128i e=_mm_add_epi32(_mm256_castsi256_si128(errors),_mm256_extracti128_si256(errors,1));
+	e=_mm_add_epi32(e,_mm_srli_si128(e,8));
+	e=_mm_add_epi32(e,_mm_srli_si128(e,4));
+	return _mm_cvtsi128_si32(e);
+}
+#endif
+
+//closest palette entry per pixel, ties go to the lower index, returns the summed squared error
+static int FitIndices(const DxtBlock& bl,const int* pr,const int* pg,const int* pb,int* indices)
+{
+#if defined(DXT_AVX2)
+	int error=FitIndicesAVX2(bl,pr,pg,pb,indices);
+#elif defined(DXT_SSE2)
+	int error=FitIndicesSSE2(bl,pr,pg,pb,indices);
+#else
+	int error=FitIndicesRef(bl,pr,pg,pb,indices);
+#endif
+#if defined(_DEBUG) && defined(DXT_SSE2)
+	int refIndices[16];
+	assert(FitIndicesRef(bl,pr,pg,pb,refIndices)==error && memcmp(refIndices,indices,sizeof(refIndices))==0);
+#endif
+	return error;
+}
+
+static void ColorRange(const DxtBlock& bl,int* lo,int* hi)
+{
+#ifdef DXT_SSE2
+	ColorRangeSSE2(bl,lo,hi);
+#ifdef _DEBUG
+	int refLo[3],refHi[3];
+	ColorRangeRef(bl,refLo,refHi);
+	assert(memcmp(refLo,lo,sizeof(refLo))==0 && memcmp(refHi,hi,sizeof(refHi))==0);
+#endif
+#else
+	ColorRangeRef(bl,lo,hi);
+#endif
+}
+
+//encodes the block with the given endpoints and keeps it if it beats the best one so far
+static void TryEndpoints(const DxtBlock& bl,int c0,int c1,DxtEncoding& best)
+{
+	if(c0<c1)
+		swap(c0,c1);
+	if(best.error>=0 && c0==best.c0 && c1==best.c1)
+		return;
+	int pr[4],pg[4],pb[4];
+	MakePalette(c0,c1,pr,pg,pb);
+	int indices[16];
+	int error=FitIndices(bl,pr,pg,pb,indices);
+	if(best.error<0 || error<best.error){
+		best.c0=c0;
+		best.c1=c1;
+		best.error=error;
+		memcpy(best.indices,indices,sizeof(indices));
+	}
+}
+
+static void PrincipalAxis(const DxtBlock& bl,float* mean,float* axis)
+{
+	mean[0]=mean[1]=mean[2]=0;
+	for(int i=0;i<16;++i){
+		mean[0]+=bl.r[i];
+		mean[1]+=bl.g[i];
+		mean[2]+=bl.b[i];
+	}
+	for(int c=0;c<3;++c)
+		mean[c]/=16;
+
+	float cov[6]={0,0,0,0,0,0};		//rr rg rb gg gb bb
+	for(int i=0;i<16;++i){
+		float r=bl.r[i]-mean[0];
+		float g=bl.g[i]-mean[1];
+		float b=bl.b[i]-mean[2];
+		cov[0]+=r*r;
+		cov[1]+=r*g;
+		cov[2]+=r*b;
+		cov[3]+=g*g;
+		cov[4]+=g*b;
+		cov[5]+=b*b;
+	}
+
+	//power iteration, starting from the row with the largest variance
+	int row=0;
+	if(cov[3]>cov[0])
+		row=1;
+	if(cov[5]>cov[row==0 ? 0 : 3])
+		row=2;
+	float v[3];
+	v[0]=row==0 ? cov[0] : row==1 ? cov[1] : cov[2];
+	v[1]=row==0 ? cov[1] : row==1 ? cov[3] : cov[4];
+	v[2]=row==0 ? cov[2] : row==1 ? cov[4] : cov[5];
+	for(int it=0;it<8;++it){
+		float x=v[0]*cov[0]+v[1]*cov[1]+v[2]*cov[2];
+		float y=v[0]*cov[1]+v[1]*cov[3]+v[2]*cov[4];
+		float z=v[0]*cov[2]+v[1]*cov[4]+v[2]*cov[5];
+		float m=max(fabs(x),max(fabs(y),fabs(z)));
+		if(m<=0)
+			break;
+		v[0]=x/m;
+		v[1]=y/m;
+		v[2]=z/m;
+	}
+	float len=sqrt(v[0]*v[0]+v[1]*v[1]+v[2]*v[2]);
+	if(len<=0){
+		axis[0]=axis[1]=axis[2]=0;
+		return;
+	}
+	for(int c=0;c<3;++c)
+		axis[c]=v[c]/len;
+}
+
+//the corners of the colour bounding box, flipped along the channels that fall as the widest one rises
+static void RangeFit(const DxtBlock& bl,const int* lo,const int* hi,DxtEncoding& best)
+{
+	const short* channels[3]={bl.r,bl.g,bl.b};
+	int widest=0;
+	for(int c=1;c<3;++c){
+		if(hi[c]-lo[c]>hi[widest]-lo[widest])
+			widest=c;
+	}
+	float start[3],end[3];
+	for(int c=0;c<3;++c){
+		int cov=0;
+		if(c!=widest){
+			int sum=0,sumWide=0,sumProd=0;
+			for(int i=0;i<16;++i){
+				sum+=channels[c][i];
+				sumWide+=channels[widest][i];
+				sumProd+=channels[c][i]*channels[widest][i];
+			}
+			cov=sumProd*16-sum*sumWide;
+		}
+		//inset the box a bit, the extremes are usually outliers
+		float inset=(hi[c]-lo[c])/16.0f;
+		start[c]=hi[c]-inset;
+		end[c]=lo[c]+inset;
+		if(cov<0)
+			swap(start[c],end[c]);
+	}
+	TryEndpoints(bl,Pack565(start[0],start[1],start[2]),Pack565(end[0],end[1],end[2]),best);
+}
+
+//least squares endpoints for the current indices
+static bool SolveEndpoints(const DxtBlock& bl,const int* indices,int& c0,int& c1)
+{
+	static const float weights[4]={1,0,2.0f/3,1.0f/3};
+	float aa=0,bb=0,ab=0;
+	float ax[3]={0,0,0},bx[3]={0,0,0};
+	for(int i=0;i<16;++i){
+		float alpha=weights[indices[i]];
+		float beta=1-alpha;
+		aa+=alpha*alpha;
+		bb+=beta*beta;
+		ab+=alpha*beta;
+		float x[3]={(float)bl.r[i],(float)bl.g[i],(float)bl.b[i]};
+		for(int c=0;c<3;++c){
+			ax[c]+=alpha*x[c];
+			bx[c]+=beta*x[c];
+		}
+	}
+	float det=aa*bb-ab*ab;
+	if(fabs(det)<1e-6f)
+		return false;
+	float a[3],b[3];
+	for(int c=0;c<3;++c){
+		a[c]=(ax[c]*bb-bx[c]*ab)/det;
+		b[c]=(bx[c]*aa-ax[c]*ab)/det;
+	}
+	c0=Pack565(a[0],a[1],a[2]);
+	c1=Pack565(b[0],b[1],b[2]);
+	return true;
+}
+
+//endpoints at the pixels furthest apart along the principal axis, then refined by least squares
+static void AxisFit(const DxtBlock& bl,const float* axis,DxtEncoding& best)
+{
+	int minPixel=0,maxPixel=0;
+	float minDot=0,maxDot=0;
+	for(int i=0;i<16;++i){
+		float d=bl.r[i]*axis[0]+bl.g[i]*axis[1]+bl.b[i]*axis[2];
+		if(i==0 || d<minDot){
+			minDot=d;
+			minPixel=i;
+		}
+		if(i==0 || d>maxDot){
+			maxDot=d;
+			maxPixel=i;
+		}
+	}
+	TryEndpoints(bl,Pack565(bl.r[maxPixel],bl.g[maxPixel],bl.b[maxPixel]),Pack565(bl.r[minPixel],bl.g[minPixel],bl.b[minPixel]),best);
+	for(int it=0;it<2;++it){
+		int c0,c1;
+		int oldError=best.error;
+		if(!SolveEndpoints(bl,best.indices,c0,c1))
+			break;
+		TryEndpoints(bl,c0,c1,best);
+		if(best.error>=oldError)
+			break;
+	}
+}
+
+//every split of the pixels, ordered along the axis, into the four palette entries
+static void ClusterFit(const DxtBlock& bl,const float* axis,DxtEncoding& best)
+{
+	float dots[16];
+	int order[16];
+	for(int i=0;i<16;++i){
+		dots[i]=bl.r[i]*axis[0]+bl.g[i]*axis[1]+bl.b[i]*axis[2];
+		order[i]=i;
+	}
+	for(int i=1;i<16;++i){
+		int o=order[i];
+		int j=i;
+		for(;j>0 && dots[order[j-1]]>dots[o];--j)
+			order[j]=order[j-1];
+		order[j]=o;
+	}
+
+	float prefix[17][3];
+	prefix[0][0]=prefix[0][1]=prefix[0][2]=0;
+	for(int i=0;i<16;++i){
+		prefix[i+1][0]=prefix[i][0]+bl.r[order[i]];
+		prefix[i+1][1]=prefix[i][1]+bl.g[order[i]];
+		prefix[i+1][2]=prefix[i][2]+bl.b[order[i]];
+	}
+
+	//[0,i0) use the first endpoint, [i0,i1) 2/3 of it, [i1,i2) 1/3 of it and the rest the second
+	float bestError=0;
+	float bestA[3]={0,0,0},bestB[3]={0,0,0};
+	bool found=false;
+	for(int i0=0;i0<=16;++i0){
+		for(int i1=i0;i1<=16;++i1){
+			for(int i2=i1;i2<=16;++i2){
+				float n0=i0,n1=i1-i0,n2=i2-i1,n3=16-i2;
+				float aa=n0+n1*(4.0f/9)+n2*(1.0f/9);
+				float bb=n3+n1*(1.0f/9)+n2*(4.0f/9);
+				float ab=(n1+n2)*(2.0f/9);
+				float det=aa*bb-ab*ab;
+				if(fabs(det)<1e-6f)
+					continue;
+				float a[3],b[3];
+				float error=0;
+				for(int c=0;c<3;++c){
+					float s0=prefix[i0][c];
+					float s1=prefix[i1][c]-prefix[i0][c];
+					float s2=prefix[i2][c]-prefix[i1][c];
+					float s3=prefix[16][c]-prefix[i2][c];
+					float ax=s0+s1*(2.0f/3)+s2*(1.0f/3);
+					float bx=s3+s1*(1.0f/3)+s2*(2.0f/3);
+					a[c]=SnapToGrid((ax*bb-bx*ab)/det,c==1 ? 63 : 31);
+					b[c]=SnapToGrid((bx*aa-ax*ab)/det,c==1 ? 63 : 31);
+					//the squared error without the constant sum of x*x
+					error+=aa*a[c]*a[c]+bb*b[c]*b[c]+2*ab*a[c]*b[c]-2*a[c]*ax-2*b[c]*bx;
+				}
+				if(!found || error<bestError){
+					found=true;
+					bestError=error;
+					memcpy(bestA,a,sizeof(a));
+					memcpy(bestB,b,sizeof(b));
+				}
+			}
+		}
+	}
+	if(found)
+		TryEndpoints(bl,Pack565(bestA[0],bestA[1],bestA[2]),Pack565(bestB[0],bestB[1],bestB[2]),best);
+}
+
+CDxtCompressor::CDxtCompressor(DxtQuality quality)
+: quality(quality)
+{
+}
+
+bool CDxtCompressor::ParseQuality(string name,DxtQuality& quality)
+{
+	if(name=="fast")
+		quality=DXT_FAST;
+	else if(name=="normal")
+		quality=DXT_NORMAL;
+	else if(name=="high")
+		quality=DXT_HIGH;
+	else
+		return false;
+	return true;
+}
+
+int CDxtCompressor::MipmappedSize(int xsize,int ysize,int numMipmaps)
+{
+	int size=0;
+	for(int a=0;a<numMipmaps;++a){
+		size+=((xsize+3)/4)*((ysize+3)/4)*8;
+		xsize=max(1,xsize/2);
+		ysize=max(1,ysize/2);
+	}
+	return size;
+}
+
+void CDxtCompressor::CompressBlock(const unsigned char* rgba,int pitch,unsigned char* block)
+{
+	DxtBlock bl;
+	for(int i=0;i<16;++i){
+		const unsigned char* p=&rgba[((i/4)*pitch+i%4)*4];
+		bl.r[i]=p[0];
+		bl.g[i]=p[1];
+		bl.b[i]=p[2];
+	}
+
+	DxtEncoding best;
+	best.error=-1;
+	int lo[3],hi[3];
+	ColorRange(bl,lo,hi);
+	if(lo[0]==hi[0] && lo[1]==hi[1] && lo[2]==hi[2]){
+		int c=Pack565(lo[0],lo[1],lo[2]);
+		TryEndpoints(bl,c,c,best);
+	} else {
+		RangeFit(bl,lo,hi,best);
+		if(quality!=DXT_FAST){
+			float mean[3],axis[3];
+			PrincipalAxis(bl,mean,axis);
+			AxisFit(bl,axis,best);
+			if(quality==DXT_HIGH)
+				ClusterFit(bl,axis,best);
+		}
+	}
+
+	unsigned int bits=0;
+	for(int i=0;i<16;++i)
+		bits|=best.indices[i]<<(i*2);
+	block[0]=best.c0&255;
+	block[1]=best.c0>>8;
+	block[2]=best.c1&255;
+	block[3]=best.c1>>8;
+	block[4]=bits&255;
+	block[5]=(bits>>8)&255;
+	block[6]=(bits>>16)&255;
+	block[7]=bits>>24;
+}
+
+void CDxtCompressor::CompressImage(const unsigned char* rgba,int xsize,int ysize,unsigned char* dst)
+{
+	unsigned char edge[16*4];
+	for(int y=0;y<ysize;y+=4){
+		for(int x=0;x<xsize;x+=4){
+			if(x+4<=xsize && y+4<=ysize){
+				CompressBlock(&rgba[(y*xsize+x)*4],xsize,dst);
+			} else {
+				for(int i=0;i<16;++i){
+					int px=min(x+i%4,xsize-1);
+					int py=min(y+i/4,ysize-1);
+					memcpy(&edge[i*4],&rgba[(py*xsize+px)*4],4);
+				}
+				CompressBlock(edge,4,dst);
+			}
+			dst+=8;
+		}
+	}
+}
+
+int CDxtCompressor::CompressMipmaps(const unsigned char* rgba,int xsize,int ysize,int numMipmaps,unsigned char* dst)
+{
+	unsigned char* start=dst;
+	vector<unsigned char> level,next;
+	const unsigned char* src=rgba;
+	for(int a=0;a<numMipmaps;++a){
+		if(a>0){
+			int nx=max(1,xsize/2);
+			int ny=max(1,ysize/2);
+			next.resize(nx*ny*4);
+			for(int y=0;y<ny;++y){
+				for(int x=0;x<nx;++x){
+					int x0=min(x*2,xsize-1),x1=min(x*2+1,xsize-1);
+					int y0=min(y*2,ysize-1),y1=min(y*2+1,ysize-1);
+					for(int c=0;c<4;++c){
+						int sum=src[(y0*xsize+x0)*4+c]+src[(y0*xsize+x1)*4+c]+src[(y1*xsize+x0)*4+c]+src[(y1*xsize+x1)*4+c];
+						next[(y*nx+x)*4+c]=(sum+2)/4;
+					}
+				}
+			}
+			level.swap(next);
+			src=&level[0];
+			xsize=nx;
+			ysize=ny;
+		}
+		CompressImage(src,xsize,ysize,dst);
+		dst+=((xsize+3)/4)*((ysize+3)/4)*8;
+	}
+	return (int)(dst-start);
+}
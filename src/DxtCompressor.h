@@ -0,0 +1,30 @@
+#ifndef __DXT_COMPRESSOR_H__
+#define __DXT_COMPRESSOR_H__
+
+#include <string>
+
+enum DxtQuality{DXT_FAST,DXT_NORMAL,DXT_HIGH};
+
+//dxt1 encoder for opaque rgba images, used instead of the external compressors
+//fast fits the endpoints to the colour range of each block, normal fits them along the principal
+//axis and refines them, high also tries every split of the block along that axis (cluster fit)
+class CDxtCompressor
+{
+public:
+	CDxtCompressor(DxtQuality quality=DXT_NORMAL);
+
+	static bool ParseQuality(std::string name,DxtQuality& quality);
+	static int MipmappedSize(int xsize,int ysize,int numMipmaps);
+
+	//pitch is the distance between two rows in pixels
+	void CompressBlock(const unsigned char* rgba,int pitch,unsigned char* block);
+	void CompressImage(const unsigned char* rgba,int xsize,int ysize,unsigned char* dst);
+	//writes numMipmaps levels after each other, each level is a 2x2 box filter of the one before
+	//returns the number of bytes written
+	int CompressMipmaps(const unsigned char* rgba,int xsize,int ysize,int numMipmaps,unsigned char* dst);
+
+private:
+	DxtQuality quality;
+};
+
+#endif // __DXT_COMPRESSOR_H__
@@ -13,8 +13,11 @@
 #endif
 #include "FeatureCreator.h"
 #include "TileHandler.h"
+#include "DxtCompressor.h"
+#include "CompressorPipe.h"
 #include "tclap/CmdLine.h"
 #include <vector>
+#include <boost/thread.hpp>
 #include "stdafx.h"
 #ifndef WIN32
 #include "time.h" /* time() */
@@ -34,6 +37,7 @@ void SaveMiniMap(ofstream &outfile);
 void SaveMetalMap(ofstream &outfile, std::string metalmap, int xsize, int ysize);
 void SaveTypeMap(ofstream &outfile,int xsize,int ysize,string typemap);
 void MapFeatures(const char *ffile, char *F_Array);
+void SaveTileLevel(string mainName,string levelName,int level);
 float* heightmap;
 short int * rotations;
 #ifndef WIN32
@@ -70,6 +74,26 @@ int main(int argc, char ** argv)
 	bool lowpassFilter=false;
 	bool usenvcompress=false;
 	bool justsmf=false;
+	int numThreads=0;
+	string tileMetric="border";
+	int maxTiles=0;
+	int maxSmtSize=0;
+	int clusterTiles=0;
+	string tileMatcher="exact";
+	bool lshRecall=false;
+	bool neighbourCache=false;
+	string tileLibrary="";
+	string tileOrder="discovery";
+	string tileMask="";
+	string tileStats="";
+	string levels="";
+	int numShards=1;
+	int tileBench=0;
+	int kernelBench=0;
+	string dxtQuality="normal";
+	bool rgbaDedup=false;
+	bool streamCompressor=false;
+	int compressJobs=0;
 	vector<string> F_Spec;
 	//-i -c 0.7 -x 608 -n -76 -o Schizo_Shores_v4.smf -m m2.bmp -t t2.bmp -a h3.raw -f f2.bmp -z "nvdxt2.exe -dxt1a -Box -quality_production -nmips 4 -fadeamount 0 -sharpenMethod SharpenSoft -file"
 
@@ -169,6 +193,106 @@ int main(int argc, char ** argv)
 			false, "fp.txt", "feature placement file");
 		cmd.add( featurePlaceArg );
 
+		ValueArg<int> threadsArg("p", "threads",
+			"Number of threads used for compressing the texture and matching tiles. 0 uses one thread per core. (Default: 0)",
+			false, 0, "threads");
+		cmd.add( threadsArg );
+
+		ValueArg<string> metricArg("", "metric",
+			"Similarity measure used when merging tiles: border compares only the outer pixel ring, full compares every pixel, ycocg compares every pixel with luma weighted over chroma, maxblock rejects a tile if any 4x4 block differs too much. (Default: border)",
+			false, "border", "border|full|ycocg|maxblock");
+		cmd.add( metricArg );
+
+		ValueArg<int> maxTilesArg("", "maxtiles",
+			"Largest number of new tiles to create. The compress factor is searched for the least compression that fits, starting from -c. (Default: 0, no limit)",
+			false, 0, "tiles");
+		cmd.add( maxTilesArg );
+
+		ValueArg<int> maxSmtSizeArg("", "maxsmtsize",
+			"Largest size in bytes of the .smt file, searched for the same way as --maxtiles. (Default: 0, no limit)",
+			false, 0, "bytes");
+		cmd.add( maxSmtSizeArg );
+
+		ValueArg<int> clusterTilesArg("", "clustertiles",
+			"Map every tile to one of exactly this many tiles found by k-means clustering, instead of merging close tiles one by one. The .smt size is then fixed and -c, --metric and --maxtiles are not used. External tile files are not searched. (Default: 0, off)",
+			false, 0, "tiles");
+		cmd.add( clusterTilesArg );
+
+		ValueArg<string> matcherArg("", "matcher",
+			"How candidate tiles are found: exact tests every tile with a close mean colour, lsh only tests tiles that share a hash bucket. lsh is meant for draft builds and can miss some close tiles. (Default: exact)",
+			false, "exact", "exact|lsh");
+		cmd.add( matcherArg );
+
+		SwitchArg lshRecallSwitch("", "lshrecall",
+			"With --matcher lsh, repeat every search with a full scan and print how many of the close tiles lsh found. Slow.",
+			false);
+		cmd.add( lshRecallSwitch );
+
+		SwitchArg neighbourCacheSwitch("", "neighbourcache",
+			"Visit the tiles of each 1024x1024 square along a hilbert curve and try the tiles used by the neighbours and the last few matches before searching all tiles. Faster on coherent textures, and may pick a different close tile than a full search.",
+			false);
+		cmd.add( neighbourCacheSwitch );
+
+		ValueArg<string> tileLibraryArg("", "tilelibrary",
+			"Tile library shared by several maps. Its tiles are used for finding tiles like an external tile file, and the new tiles of this map are appended to it instead of being saved in a new tile file. An index with the extension .sti is kept next to it so its tiles are not decoded on every run. Created if it does not exist.",
+			false, "", "tile library .smt");
+		cmd.add( tileLibraryArg );
+
+		ValueArg<string> tileMaskArg("", "tilemask",
+			"Greyscale image scaling the merge thresholds of each tile by its brightness / 128, scaled to the texture like the typemap. Mid grey keeps -c, white about doubles it and black only merges identical tiles. Not used with --clustertiles. (Default: none)",
+			false, "", "mask image");
+		cmd.add( tileMaskArg );
+
+		ValueArg<string> tileStatsArg("", "tilestats",
+			"Record how each tile was matched and write name.tga, a map with the error to the tile used in red, the search cost in green and new tiles in blue, and name.json with the totals and a histogram of the match errors. Not used with --clustertiles. (Default: off)",
+			false, "", "name");
+		cmd.add( tileStatsArg );
+
+		ValueArg<string> levelsArg("", "levels",
+			"Comma separated compress factors to also make variants of the map with, in the same run. Each gets its own name_c<factor>.smf and .smt next to -o, made from the tiles decoded for the main one, which is much faster than running again. Not used with --clustertiles or --tilelibrary. (Default: none)",
+			false, "", "factor,factor,...");
+		cmd.add( levelsArg );
+
+		ValueArg<int> shardsArg("", "shards",
+			"Spread the new tiles over this many .smt files named name_0.smt, name_1.smt and so on, each written by its own thread while the tiles are made. Not used with --tilelibrary. (Default: 1)",
+			false, 1, "files");
+		cmd.add( shardsArg );
+
+		ValueArg<string> tileOrderArg("", "tileorder",
+			"Order of the new tiles in the .smt: discovery keeps the order they are created in, morton and hilbert sort them by first use along that curve over the map so the tiles of a region are close together in the file. (Default: discovery)",
+			false, "discovery", "discovery|morton|hilbert");
+		cmd.add( tileOrderArg );
+
+		ValueArg<int> tileBenchArg("", "tilebench",
+			"After saving, read the tiles of this many random rectangles of the map from the .smt and print how many separate reads they took and how long. (Default: 0, off)",
+			false, 0, "views");
+		cmd.add( tileBenchArg );
+
+		ValueArg<int> kernelBenchArg("", "kernelbench",
+			"After saving, time the plain and sse2 versions of the tile stat and tile compare code on this many tiles from the .smt, and check that they agree. (Default: 0, off)",
+			false, 0, "tiles");
+		cmd.add( kernelBenchArg );
+
+		ValueArg<string> dxtArg("", "dxt",
+			"Quality of the built in dxt1 compression of the texture and minimap: fast fits each block to its colour range, normal also along its main colour axis and high tries every split of the block along that axis, which is several times slower. external runs the program given with -z, or nvcompress with -q, which is also used when one of those is given without --dxt. (Default: normal)",
+			false, "normal", "fast|normal|high|external");
+		cmd.add( dxtArg );
+
+		SwitchArg rgbaDedupSwitch("", "rgbadedup",
+			"Cut the tiles straight from the texture and only compress the ones with distinct pixels, instead of compressing every big square. The tiles are then matched by their exact pixels rather than the compressed ones, and no big squares are written to temp. Needs the built in compressor, see --dxt.",
+			false);
+		cmd.add( rgbaDedupSwitch );
+
+		SwitchArg streamSwitch("", "stream",
+			"Run the -z compressor with --stream and hand it the big squares and minimap as raw rgba over its stdin and stdout, as texcompress_nogui --stream does, instead of going through tga and .raw files in temp. Falls back to the files if the compressor can't do it. Not used with -q, and needs --dxt external if --dxt is given.",
+			false);
+		cmd.add( streamSwitch );
+
+		ValueArg<int> compressJobsArg("", "compressjobs",
+			"Number of external compressor processes run at once, each given one big square, with -z or -q. A compressor that fails on a square is run again up to 2 times, then no map is written. 0 runs the -z compressor once over all squares and nvcompress one square at a time. With --stream it is the number of compressors fed at once. (Default: 0)",
+			false, 0, "jobs");
+		cmd.add( compressJobsArg );
+
 		// Parse the args.
 		cmd.parse( argc, argv );
 
@@ -192,13 +316,88 @@ int main(int argc, char ** argv)
 		justsmf=justsmfSwitch.getValue();
 		randomrotatefeatures=rrArg.getValue();
 		featurePlaceFile=featurePlaceArg.getValue();
+		numThreads=threadsArg.getValue();
+		tileMetric=metricArg.getValue();
+		maxTiles=maxTilesArg.getValue();
+		maxSmtSize=maxSmtSizeArg.getValue();
+		clusterTiles=clusterTilesArg.getValue();
+		tileMatcher=matcherArg.getValue();
+		lshRecall=lshRecallSwitch.getValue();
+		neighbourCache=neighbourCacheSwitch.getValue();
+		tileLibrary=tileLibraryArg.getValue();
+		tileOrder=tileOrderArg.getValue();
+		tileMask=tileMaskArg.getValue();
+		tileStats=tileStatsArg.getValue();
+		levels=levelsArg.getValue();
+		numShards=shardsArg.getValue();
+		dxtQuality=dxtArg.getValue();
+		rgbaDedup=rgbaDedupSwitch.getValue();
+		streamCompressor=streamSwitch.getValue();
+		compressJobs=compressJobsArg.getValue();
+		if(!dxtArg.isSet() && (texCompressArg.isSet() || usenvcompress || streamCompressor))
+			dxtQuality="external";
+		tileBench=tileBenchArg.getValue();
+		kernelBench=kernelBenchArg.getValue();
 	} catch (ArgException &e)  // catch any exceptions
 	{ cerr << "error: " << e.error() << " for arg " << e.argId() << endl; exit(-1);}
 
+	if(numThreads<=0)
+		numThreads=max(1,(int)boost::thread::hardware_concurrency());
+	tileHandler.numThreads=numThreads;
+	if(!tileHandler.SetTileMetric(tileMetric)){
+		printf("Unknown tile metric %s, using border\n",tileMetric.c_str());
+		tileHandler.SetTileMetric("border");
+	}
+	if(maxSmtSize>0){
+		int smtTiles=max(1,(maxSmtSize-(int)sizeof(TileFileHeader))/SMALL_TILE_SIZE);
+		maxTiles=maxTiles>0 ? min(maxTiles,smtTiles) : smtTiles;
+	}
+	tileHandler.maxNewTiles=maxTiles;
+	tileHandler.clusterTiles=clusterTiles;
+	if(!tileHandler.SetTileMatcher(tileMatcher)){
+		printf("Unknown tile matcher %s, using exact\n",tileMatcher.c_str());
+		tileHandler.SetTileMatcher("exact");
+	}
+	tileHandler.checkLshRecall=lshRecall;
+	tileHandler.neighbourCache=neighbourCache;
+	tileHandler.tileStatsName=tileStats;
+	tileHandler.numShards=max(1,numShards);
+	vector<string> levelNames;
+	for(size_t start=0;start<levels.size();){
+		size_t end=levels.find(',',start);
+		if(end==string::npos)
+			end=levels.size();
+		string factor=levels.substr(start,end-start);
+		if(!factor.empty()){
+			tileHandler.levelFactors.push_back((float)atof(factor.c_str()));
+			levelNames.push_back(outfilename.substr(0,outfilename.find_last_of('.'))+"_c"+factor+".smf");
+		}
+		start=end+1;
+	}
+	if(!tileHandler.SetTileOrder(tileOrder)){
+		printf("Unknown tile order %s, using discovery\n",tileOrder.c_str());
+		tileHandler.SetTileOrder("discovery");
+	}
+	if(!tileHandler.SetDxtQuality(dxtQuality)){
+		printf("Unknown dxt quality %s, using normal\n",dxtQuality.c_str());
+		tileHandler.SetDxtQuality("normal");
+	}
+	if(streamCompressor && tileHandler.dxtQuality>=0){
+		printf("--stream needs --dxt external, not using it\n");
+		streamCompressor=false;
+	}
+	tileHandler.rgbaDedup=rgbaDedup;
+	tileHandler.streamCompressor=streamCompressor;
+	tileHandler.compressJobs=compressJobs;
+
 	tileHandler.LoadTexture(intexname);
+	if(!tileMask.empty())
+		tileHandler.LoadTileMask(tileMask);
 	tileHandler.SetOutputFile(outfilename);
 	if(!extTileFile.empty())
 		tileHandler.AddExternalTileFile(extTileFile);
+	if(!tileLibrary.empty())
+		tileHandler.SetTileLibrary(tileLibrary);
 
 	xsize=tileHandler.xsize;
 	ysize=tileHandler.ysize;
@@ -328,7 +527,10 @@ int main(int argc, char ** argv)
 		printf("Invalid compressor string for CUDA compress, using default of nvcompress.exe -fast -bc1\n");
 
 	}
-	tileHandler.ProcessTiles(compressFactor,usenvcompress);
+	if(!tileHandler.ProcessTiles(compressFactor,usenvcompress)){
+		printf("Couldnt make the tiles, no map written\n");
+		exit(-1);
+	}
 
 #ifdef WIN32
 	LARGE_INTEGER li;
@@ -386,16 +588,76 @@ int main(int argc, char ** argv)
 	SaveMetalMap(outfile, metalmap,xsize,ysize);
 
 	featureCreator.WriteToFile(&outfile, F_Spec);
+	outfile.close();
+
+	if(tileBench>0)
+		tileHandler.BenchmarkTileReads(tileBench);
+	if(kernelBench>0)
+		tileHandler.BenchmarkKernels(kernelBench);
+
+	for(int l=0;l<(int)tileHandler.tileLevels.size();++l)
+		SaveTileLevel(outfilename,levelNames[l],l);
 
 	delete[] heightmap;
 	return 0;
 }
 
+void SaveTileLevel(string mainName,string levelName,int level)
+{
+	//everything but the tiles is the same as in the main map, so copy it and move what
+	//follows the tiles by the difference in size of the tile section
+	ifstream ifs(mainName.c_str(),ios::in|ios::binary);
+	vector<char> smf;
+	char buf[65536];
+	while(ifs.read(buf,sizeof(buf)) || ifs.gcount()>0)
+		smf.insert(smf.end(),buf,buf+ifs.gcount());
+	ifs.close();
+
+	MapHeader header;
+	memcpy(&header,&smf[0],sizeof(MapHeader));
+	int oldTilesEnd=header.metalmapPtr;
+
+	printf("Writing %s\n",levelName.c_str());
+	tileHandler.SetOutputFile(levelName);
+	tileHandler.UseLevel(level);
+	int delta=tileHandler.GetFileSize()-(header.metalmapPtr-header.tilesPtr);
+	header.metalmapPtr+=delta;
+	header.featurePtr+=delta;
+
+	ofstream outfile(levelName.c_str(), ios::out|ios::binary);
+	outfile.write((char*)&header,sizeof(MapHeader));
+	int temp;
+	outfile.write(&smf[sizeof(MapHeader)],8);		//vegetation extra header size and type
+	memcpy(&temp,&smf[sizeof(MapHeader)+8],4);
+	temp+=delta;
+	outfile.write((char*)&temp,4);
+	outfile.write(&smf[sizeof(MapHeader)+12],header.tilesPtr-sizeof(MapHeader)-12);
+	tileHandler.SaveData(outfile);
+	outfile.write(&smf[oldTilesEnd],smf.size()-oldTilesEnd);
+}
+
 void SaveMiniMap(ofstream &outfile)
 {
 	printf("creating minimap\n");
 
 	CBitmap mini = tileHandler.bigTex.CreateRescaled(1024, 1024);
+	if(tileHandler.dxtQuality>=0){
+		CDxtCompressor compressor((DxtQuality)tileHandler.dxtQuality);
+		vector<unsigned char> minidata(MINIMAP_SIZE);
+		compressor.CompressMipmaps(mini.mem, 1024, 1024, 9, &minidata[0]);
+		outfile.write((char*)&minidata[0], MINIMAP_SIZE);
+		return;
+	}
+	if(tileHandler.streamCompressor){
+		string command=stupidGlobalCompressorName+" --stream";
+		CCompressorPipe compressor(command);
+		vector<unsigned char> minidata(MINIMAP_SIZE);
+		if(compressor.Compress(mini.mem, 1024, 1024, 9, &minidata[0], MINIMAP_SIZE)){
+			outfile.write((char*)&minidata[0], MINIMAP_SIZE);
+			return;
+		}
+		printf("%s failed on the minimap, using mini.bmp\n", command.c_str());
+	}
 	mini.Save("mini.bmp");
 	#ifdef WIN32
 	try{
@@ -0,0 +1,76 @@
+#include "MappedFile.h"
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::CMappedFile(std::string filename)
+: data(0),
+  size(0)
+{
+#ifdef WIN32
+	mapping=0;
+	file=CreateFileA(filename.c_str(),GENERIC_READ,FILE_SHARE_READ,0,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,0);
+	if(file==INVALID_HANDLE_VALUE){
+		file=0;
+		return;
+	}
+	LARGE_INTEGER fileSize;
+	if(!GetFileSizeEx(file,&fileSize) || fileSize.QuadPart==0)
+		return;
+	mapping=CreateFileMapping(file,0,PAGE_READONLY,0,0,0);
+	if(!mapping)
+		return;
+	data=(const char*)MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+	if(data)
+		size=(size_t)fileSize.QuadPart;
+#else
+	fd=open(filename.c_str(),O_RDONLY);
+	if(fd<0)
+		return;
+	struct stat st;
+	if(fstat(fd,&st)!=0 || st.st_size==0)
+		return;
+	void* p=mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	if(p==MAP_FAILED)
+		return;
+	data=(const char*)p;
+	size=st.st_size;
+#endif
+}
+
+CMappedFile::~CMappedFile(void)
+{
+#ifdef WIN32
+	if(data)
+		UnmapViewOfFile(data);
+	if(mapping)
+		CloseHandle(mapping);
+	if(file)
+		CloseHandle(file);
+#else
+	if(data)
+		munmap((void*)data,size);
+	if(fd>=0)
+		close(fd);
+#endif
+}
+
+bool CMappedFile::IsOpen()
+{
+	return data!=0;
+}
+
+const char* CMappedFile::Data()
+{
+	return data;
+}
+
+size_t CMappedFile::Size()
+{
+	return size;
+}
@@ -0,0 +1,30 @@
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <string>
+
+//read only view of a whole file, the pages are loaded by the os when they are touched
+class CMappedFile
+{
+public:
+	CMappedFile(std::string filename);
+	~CMappedFile(void);
+
+	bool IsOpen();
+	const char* Data();
+	size_t Size();
+private:
+	CMappedFile(const CMappedFile&);
+	CMappedFile& operator=(const CMappedFile&);
+
+	const char* data;
+	size_t size;
+#ifdef WIN32
+	void* file;
+	void* mapping;
+#else
+	int fd;
+#endif
+};
+
+#endif // __MAPPED_FILE_H__
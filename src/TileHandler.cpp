@@ -2,281 +2,2606 @@
 #include "FileHandler.h"
 #ifdef WIN32
 #include "ddraw.h"
+#else
+#include <sys/wait.h>
 #endif
 #include "mapfile.h"
+#include "MappedFile.h"
+#include "DxtCompressor.h"
+#include "CompressorPipe.h"
 #include <string.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <limits.h>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 extern string stupidGlobalCompressorName; /* MapConv.cpp */
 
 CTileHandler tileHandler;
 
 CTileHandler::CTileHandler()
+: tileMetric(METRIC_BORDER),
+  matchDataSize(TILE_BORDER_SIZE),
+  tileMatcher(MATCHER_EXACT),
+  checkLshRecall(false),
+  lshSearches(0),
+  lshFound(0),
+  numThreads(1),
+  neighbourCache(false),
+  cacheLookups(0),
+  cacheHits(0),
+  maxNewTiles(0),
+  clusterTiles(0),
+  numLazyTiles(0),
+  numLibraryTiles(0),
+  tileOrder(ORDER_DISCOVERY),
+  recordStats(false),
+  prepareSeconds(0),
+  settleSeconds(0),
+  numShards(1),
+  shardWriters(0),
+  streamedTiles(0),
+  pendingFirst(0),
+  dxtQuality(DXT_NORMAL),
+  compressedSquares(0),
+  rgbaDedup(false),
+  streamCompressor(false),
+  compressJobs(0),
+  nextSquare(0),
+  failedSquares(0),
+  streamFailed(false)
 {
 }
 
 CTileHandler::~CTileHandler(void)
 {
-	for(int a=0;a<usedTiles;++a)
-		delete tiles[a];
+	JoinShardWriters();
+	for(size_t k=0;k<shardFiles.size();++k)
+		delete shardFiles[k];
+	for(vector<CMappedFile*>::iterator mi=mappedFiles.begin();mi!=mappedFiles.end();++mi)
+		delete *mi;
+}
+
+void CTileHandler::LoadTexture(string name)
+{
+	printf("Loading texture\n");
+	bigTex.Load(name);
+
+	xsize=bigTex.xsize/8;
+	ysize=bigTex.ysize/8;
+}
+
+void CTileHandler::SetCompressFactor(float compressFactor)
+{
+	this->compressFactor=compressFactor;
+	meanThreshold=(int)(2000*compressFactor);
+	meanDirThreshold=(int)(20000*compressFactor);
+	borderThreshold=(int)(80000*compressFactor);
+
+	switch(tileMetric){
+	case METRIC_FULL:
+	case METRIC_YCOCG:
+		matchThreshold=(int)(borderThreshold*(1024.0/TILE_BORDER_PIXELS));
+		break;
+	case METRIC_MAXBLOCK:
+		matchThreshold=(int)(borderThreshold*(16.0/TILE_BORDER_PIXELS));
+		break;
+	default:
+		matchThreshold=borderThreshold;
+		break;
+	}
+}
+
+CTileHandler::Thresholds CTileHandler::ScaledThresholds(int level)
+{
+	//the thresholds for a tile with this mask value, 128 keeps the ones from the compress factor
+	Thresholds th;
+	th.mean=meanThreshold;
+	th.meanDir=meanDirThreshold;
+	th.match=matchThreshold;
+	if(level!=128){
+		double scale=level/128.0;
+		th.mean=(int)min(meanThreshold*scale,(double)INT_MAX);
+		th.meanDir=(int)min(meanDirThreshold*scale,(double)INT_MAX);
+		th.match=(int)min(matchThreshold*scale,(double)INT_MAX);
+	}
+	return th;
+}
+
+void CTileHandler::LoadTileMask(string name)
+{
+	//one value per tile, read from the red channel of the mask scaled down to the tile grid
+	int tilex=xsize/4;
+	int tiley=ysize/4;
+	CBitmap mask;
+	mask.Load(name);
+	if(mask.xsize!=xsize*8 && mask.xsize!=tilex)
+		printf("Tile mask %s is %i*%i, scaling it to the %i*%i texture\n",name.c_str(),mask.xsize,mask.ysize,xsize*8,ysize*8);
+	CBitmap mask2=mask.CreateRescaled(tilex,tiley);
+	tileMask.resize(tilex*tiley);
+	for(int a=0;a<tilex*tiley;++a)
+		tileMask[a]=mask2.mem[a*4];
+}
+
+int CTileHandler::MaskLevel(int square,int b)
+{
+	if(tileMask.empty())
+		return 128;
+	int tilex=xsize/4;
+	int xb=(square%(tilex/32))*32+b%32;
+	int yb=(square/(tilex/32))*32+b/32;
+	return tileMask[yb*tilex+xb];
+}
+
+bool CTileHandler::SetTileMetric(string name)
+{
+	if(name=="border")
+		tileMetric=METRIC_BORDER;
+	else if(name=="full")
+		tileMetric=METRIC_FULL;
+	else if(name=="ycocg")
+		tileMetric=METRIC_YCOCG;
+	else if(name=="maxblock")
+		tileMetric=METRIC_MAXBLOCK;
+	else
+		return false;
+	SetMatchDataSize();
+	return true;
+}
+
+bool CTileHandler::SetTileOrder(string name)
+{
+	if(name=="discovery")
+		tileOrder=ORDER_DISCOVERY;
+	else if(name=="morton")
+		tileOrder=ORDER_MORTON;
+	else if(name=="hilbert")
+		tileOrder=ORDER_HILBERT;
+	else
+		return false;
+	return true;
+}
+
+bool CTileHandler::SetDxtQuality(string name)
+{
+	if(name=="external"){
+		dxtQuality=-1;
+		return true;
+	}
+	DxtQuality quality;
+	if(!CDxtCompressor::ParseQuality(name,quality))
+		return false;
+	dxtQuality=quality;
+	return true;
+}
+
+bool CTileHandler::SetTileMatcher(string name)
+{
+	if(name=="exact")
+		tileMatcher=MATCHER_EXACT;
+	else if(name=="lsh")
+		tileMatcher=MATCHER_LSH;
+	else
+		return false;
+	if(tileMatcher==MATCHER_LSH)
+		InitLsh();
+	SetMatchDataSize();
+	return true;
+}
+
+void CTileHandler::SetMatchDataSize(void)
+{
+	if(tileMetric==METRIC_BORDER)
+		matchDataSize=TILE_BORDER_SIZE;
+	else if(tileMetric==METRIC_MAXBLOCK)
+		matchDataSize=TILE_PIXELS_SIZE;		//already stops at the first bad block
+	else
+		matchDataSize=TILE_PIXELS_SIZE+TILE_COARSE_SIZE;
+	if(tileMatcher==MATCHER_LSH)
+		matchDataSize+=TILE_SKETCH_SIZE;
+}
+
+bool CTileHandler::ProcessTiles(float compressFactor,bool fastcompress)
+{
+	SetCompressFactor(compressFactor);
+
+	system("mkdir temp");
+
+	usedTiles=0;
+	fastStats.clear();
+	tileMatchData.clear();
+	lazyTiles.clear();
+	lazyMatchData.clear();
+	numLazyTiles=0;
+	statIndex.clear();
+	for(int t=0;t<LSH_TABLES;++t)
+		lshTables[t].clear();
+	duplicateTiles.clear();
+	numDuplicateTiles=0;
+
+	for(vector<string>::iterator fi=externalFiles.begin();fi!=externalFiles.end();++fi)
+		LoadExternalFile(*fi);
+	if(!tileLibrary.empty() && !LoadTileLibrary())
+		return false;
+
+	numExternalTile=usedTiles;
+	AddLibraryDuplicates();
+
+	int numbigsquares=(xsize/128)*(ysize/128);
+	if(rgbaDedup && dxtQuality<0){
+		printf("Rgba dedup needs the built in compressor, not using it\n");
+		rgbaDedup=false;
+	}
+	if(rgbaDedup){
+		DedupTilesRGBA();
+		return true;
+	}
+	if(dxtQuality>=0){
+		//every square is independent, so they are spread over the threads
+		int threads=max(1,numThreads);
+		printf("Compressing %i big squares with %i threads\n",numbigsquares,threads);
+		compressedSquares=0;
+		boost::thread_group workers;
+		for(int t=1;t<threads;++t)
+			workers.create_thread(boost::bind(&CTileHandler::CompressBigSquares,this,t));
+		CompressBigSquares(0);
+		workers.join_all();
+		return true;
+	}
+
+	if(streamCompressor && !fastcompress && StreamBigSquares())
+		return true;
+
+	unsigned char* data=new unsigned char[1024*1024*4];
+	for(int a=0;a<numbigsquares;a++){
+		CopyBigSquare(a,data);
+		CBitmap square(data,1024,1024);
+		char name[100];
+		sprintf(name,"temp/Temp%03i.tga",a);
+		square.Save(name);
+		printf("Writing tga files %i%%\n", ((a+1)*100)/numbigsquares);
+	}
+	delete[] data;
+
+	printf("Creating dds files\n");
+	char execstring[512];
+	bool compressed=true;
+	if(compressJobs>0){
+		compressed=RunCompressJobs(fastcompress);
+	}else if (fastcompress){
+		for (int i=0;i<numbigsquares;i++){
+			sprintf(execstring, "nvcompress.exe -fast -bc1a temp/Temp%03i.tga Temp%03i.dds",i,i);
+			printf("%s\n", execstring);
+			system(execstring);
+		}
+	
+	}else{
+		sprintf(execstring, "%s temp/Temp*.tga",stupidGlobalCompressorName.c_str());
+		printf("%s\n", execstring);
+		system(execstring);
+	}
+#ifdef WIN32
+	system("del /Q temp\\Temp*.tga");
+	system("del /Q temp");
+#else	
+	system("rm temp/Temp*.tga");
+#endif
+	return compressed;
+}
+
+void CTileHandler::CopyBigSquare(int num,unsigned char* data)
+{
+	int bigsquaretexx=xsize/128;
+	int ox=1024*(num%bigsquaretexx);
+	int oy=1024*(num/bigsquaretexx);
+	for(int y2=0;y2<1024;++y2)
+		memcpy(&data[y2*1024*4],&bigTex.mem[(ox +(oy+y2)*xsize*8)*4],1024*4);
+}
+
+void CTileHandler::CompressBigSquares(int thread)
+{
+	int numbigsquares=(xsize/128)*(ysize/128);
+	int threads=max(1,numThreads);
+	vector<unsigned char> data(1024*1024*4);
+	vector<unsigned char> compressed(CDxtCompressor::MipmappedSize(1024,1024,4));
+	CDxtCompressor compressor((DxtQuality)dxtQuality);
+	for(int a=thread;a<numbigsquares;a+=threads){
+		CopyBigSquare(a,&data[0]);
+		//the layout texcompress_nogui writes, 1024x1024 and the first 3 mipmaps
+		compressor.CompressMipmaps(&data[0],1024,1024,4,&compressed[0]);
+		char name[100];
+		sprintf(name,"temp/Temp%03i.bmp.raw",a);
+		ofstream ofs(name,ios::binary | ios::out);
+		ofs.write((char*)&compressed[0],compressed.size());
+
+		boost::mutex::scoped_lock lock(compressMutex);
+		compressedSquares++;
+		printf("Compressed big square %i, %i of %i\n",a,compressedSquares,numbigsquares);
+	}
+}
+
+bool CTileHandler::RunCompressJobs(bool fastcompress)
+{
+	int numbigsquares=(xsize/128)*(ysize/128);
+	int jobs=max(1,min(compressJobs,numbigsquares));
+	printf("Running %i compressor processes at once\n",jobs);
+	nextSquare=0;
+	compressedSquares=0;
+	failedSquares=0;
+	boost::thread_group workers;
+	for(int t=0;t<jobs;++t)
+		workers.create_thread(boost::bind(&CTileHandler::CompressJob,this,fastcompress));
+	workers.join_all();
+	if(failedSquares>0){
+		printf("The compressor failed on %i of %i big squares\n",failedSquares,numbigsquares);
+		return false;
+	}
+	return true;
+}
+
+static int RunCompressor(const char* execstring)
+{
+	//the exit code of the compressor, or -1 if it couldnt be run
+	int status=system(execstring);
+#ifndef WIN32
+	if(status!=-1)
+		status=WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+	return status;
+}
+
+void CTileHandler::CompressJob(bool fastcompress)
+{
+	//each job runs one compressor process at a time and takes the next square when it is done,
+	//so a slow square doesnt hold up the others
+	int numbigsquares=(xsize/128)*(ysize/128);
+	for(;;){
+		int a;
+		{
+			boost::mutex::scoped_lock lock(compressMutex);
+			a=nextSquare++;
+		}
+		if(a>=numbigsquares)
+			return;
+		char execstring[512];
+		if(fastcompress)
+			sprintf(execstring, "nvcompress.exe -fast -bc1a temp/Temp%03i.tga Temp%03i.dds",a,a);
+		else
+			snprintf(execstring, 512, "%s temp/Temp%03i.tga",stupidGlobalCompressorName.c_str(),a);
+		int status=RunCompressor(execstring);
+		for(int retry=0;retry<COMPRESS_RETRIES && status!=0;++retry){
+			printf("%s failed with status %i, retrying\n",execstring,status);
+			status=RunCompressor(execstring);
+		}
+
+		boost::mutex::scoped_lock lock(compressMutex);
+		if(status!=0){
+			failedSquares++;
+			printf("%s failed with status %i, giving up on big square %i\n",execstring,status,a);
+		}else{
+			compressedSquares++;
+			printf("Compressed big square %i, %i of %i\n",a,compressedSquares,numbigsquares);
+		}
+	}
+}
+
+bool CTileHandler::StreamBigSquares(void)
+{
+	//every job keeps one compressor process busy, their output is kept in memory
+	int numbigsquares=(xsize/128)*(ysize/128);
+	int jobs=max(1,min(compressJobs,numbigsquares));
+	streamedSquares.resize((size_t)numbigsquares*696320);
+	nextSquare=0;
+	compressedSquares=0;
+	streamFailed=false;
+	boost::thread_group workers;
+	for(int t=1;t<jobs;++t)
+		workers.create_thread(boost::bind(&CTileHandler::StreamJob,this));
+	StreamJob();
+	workers.join_all();
+	if(streamFailed){
+		vector<char>().swap(streamedSquares);
+		return false;
+	}
+	return true;
+}
+
+void CTileHandler::StreamJob(void)
+{
+	string command=stupidGlobalCompressorName+" --stream";
+	int numbigsquares=(xsize/128)*(ysize/128);
+	CCompressorPipe* compressor=0;
+	vector<unsigned char> data(1024*1024*4);
+	for(;;){
+		int a;
+		{
+			boost::mutex::scoped_lock lock(compressMutex);
+			if(streamFailed)
+				break;
+			a=nextSquare++;
+		}
+		if(a>=numbigsquares)
+			break;
+		CopyBigSquare(a,&data[0]);
+		bool done=false;
+		for(int attempt=0;attempt<=COMPRESS_RETRIES && !done;++attempt){
+			if(!compressor || !compressor->IsOpen()){
+				//a failed compressor is closed, so it is started again for the retry, the processes
+				//are started one at a time so none of them inherits the pipes of another
+				boost::mutex::scoped_lock lock(compressMutex);
+				if(attempt>0)
+					printf("%s failed on big square %i, retrying\n",command.c_str(),a);
+				delete compressor;
+				compressor=new CCompressorPipe(command);
+			}
+			done=compressor->Compress(&data[0],1024,1024,4,(unsigned char*)&streamedSquares[(size_t)a*696320],696320);
+		}
+
+		boost::mutex::scoped_lock lock(compressMutex);
+		if(!done){
+			if(!streamFailed)
+				printf("%s failed on big square %i, using temp files\n",command.c_str(),a);
+			streamFailed=true;
+			break;
+		}
+		compressedSquares++;
+		printf("Compressed big square %i, %i of %i\n",a,compressedSquares,numbigsquares);
+	}
+	delete compressor;
+}
+
+const unsigned char* CTileHandler::TilePixels(int n,int y)
+{
+	//row y of map tile n in the texture
+	int a=n/1024;
+	int b=n%1024;
+	int bigx=xsize/128;
+	int px=(a%bigx)*1024+(b%32)*32;
+	int py=(a/bigx)*1024+(b/32)*32+y;
+	return &bigTex.mem[((size_t)py*xsize*8+px)*4];
+}
+
+bool CTileHandler::SameTilePixels(int n,int n2)
+{
+	for(int y=0;y<32;++y){
+		if(memcmp(TilePixels(n,y),TilePixels(n2,y),32*4)!=0)
+			return false;
+	}
+	return true;
+}
+
+void CTileHandler::DedupTilesRGBA(void)
+{
+	//identical pixels always encode to the same dxt1, the mipmaps of a tile are the ones
+	//of its big square, so each distinct tile is encoded once and only those are kept
+	int numTiles=(xsize/128)*(ysize/128)*1024;
+	int threads=max(1,numThreads);
+	rgbaHashes.resize(numTiles);
+	boost::thread_group hashers;
+	for(int t=1;t<threads;++t)
+		hashers.create_thread(boost::bind(&CTileHandler::HashTilesRGBA,this,t));
+	HashTilesRGBA(0);
+	hashers.join_all();
+
+	//hash collisions are told apart by comparing the pixels, the later tile is then
+	//taken as distinct without an entry of its own
+	map<unsigned long long,int> firstTile;
+	rgbaTileIndex.resize(numTiles);
+	rgbaSources.clear();
+	for(int n=0;n<numTiles;++n){
+		map<unsigned long long,int>::iterator fi=firstTile.find(rgbaHashes[n]);
+		if(fi!=firstTile.end() && SameTilePixels(rgbaSources[fi->second],n)){
+			rgbaTileIndex[n]=fi->second;
+			continue;
+		}
+		if(fi==firstTile.end())
+			firstTile[rgbaHashes[n]]=(int)rgbaSources.size();
+		rgbaTileIndex[n]=(int)rgbaSources.size();
+		rgbaSources.push_back(n);
+	}
+	vector<unsigned long long>().swap(rgbaHashes);
+
+	int numDistinct=(int)rgbaSources.size();
+	printf("Encoding %i distinct tiles out of %i with %i threads\n",numDistinct,numTiles,threads);
+	rgbaTiles.resize((size_t)numDistinct*SMALL_TILE_SIZE);
+	rgbaTileHashes.resize(numDistinct);
+	rgbaStats.resize(numDistinct);
+	rgbaMatchData.resize((size_t)numDistinct*matchDataSize);
+	boost::thread_group encoders;
+	for(int t=1;t<threads;++t)
+		encoders.create_thread(boost::bind(&CTileHandler::EncodeTilesRGBA,this,t));
+	EncodeTilesRGBA(0);
+	encoders.join_all();
+	vector<int>().swap(rgbaSources);
+}
+
+void CTileHandler::HashTilesRGBA(int thread)
+{
+	int numTiles=(int)rgbaHashes.size();
+	int threads=max(1,numThreads);
+	for(int n=thread;n<numTiles;n+=threads){
+		unsigned long long hash=14695981039346656037ULL;
+		for(int y=0;y<32;++y){
+			const unsigned char* row=TilePixels(n,y);
+			for(int x=0;x<32*4;x+=8){
+				unsigned long long pixels;
+				memcpy(&pixels,&row[x],8);
+				hash^=pixels;
+				hash*=1099511628211ULL;
+				hash^=hash>>32;
+			}
+		}
+		rgbaHashes[n]=hash;
+	}
+}
+
+void CTileHandler::EncodeTilesRGBA(int thread)
+{
+	int numDistinct=(int)rgbaSources.size();
+	int threads=max(1,numThreads);
+	CDxtCompressor compressor((DxtQuality)dxtQuality);
+	unsigned char rgba[32*32*4];
+	for(int u=thread;u<numDistinct;u+=threads){
+		for(int y=0;y<32;++y)
+			memcpy(&rgba[y*32*4],TilePixels(rgbaSources[u],y),32*4);
+		char* tile=&rgbaTiles[(size_t)u*SMALL_TILE_SIZE];
+		compressor.CompressMipmaps(rgba,32,32,4,(unsigned char*)tile);
+		rgbaTileHashes[u]=HashTileData(tile);
+
+		//the tiles are matched by their exact pixels instead of the decoded ones
+		CBitmap bm(rgba,32,32);
+		rgbaStats[u]=CalcFastStat(&bm);
+		ExtractMatchData(bm.mem,&rgbaMatchData[(size_t)u*matchDataSize]);
+		delete[] bm.mem;
+
+		if(thread==0 && (u/threads)%1024==0)
+			printf("Encoding tiles %i%%\n",(u*100)/numDistinct);
+	}
+}
+
+void CTileHandler::LoadExternalFile(string file)
+{
+	//the tiles stay in the mapped file and their match data is decoded when a search needs it
+	CMappedFile* mf=new CMappedFile(file);
+	if(!mf->IsOpen()){
+		printf("Couldnt find tile file %s\n",file.c_str());
+		delete mf;
+		return;
+	}
+	TileFileHeader tfh;
+	if(mf->Size()<sizeof(TileFileHeader)){
+		printf("Error opening tile file %s\n",file.c_str());
+		delete mf;
+		return;
+	}
+	memcpy(&tfh,mf->Data(),sizeof(TileFileHeader));
+
+	if(strcmp(tfh.magic,"spring tilefile")!=0 || tfh.version!=1 || tfh.tileSize!=32 || tfh.numTiles<0
+	|| mf->Size()<sizeof(TileFileHeader)+(size_t)tfh.numTiles*SMALL_TILE_SIZE){
+		printf("Error opening tile file %s\n",file.c_str());
+		delete mf;
+		return;
+	}
+	mappedFiles.push_back(mf);
+	externalFileTileSize.push_back(tfh.numTiles);
+
+	printf("Loading %i tiles from %s\n",tfh.numTiles,file.c_str());
+	const char* tiles=mf->Data()+sizeof(TileFileHeader);
+	int firstTile=usedTiles;
+	fastStats.resize(firstTile+tfh.numTiles);
+
+	//the stats do not depend on the settings so any index left next to the file can give them
+	string indexName=file.substr(0,file.find_last_of('.'))+".sti";
+	CMappedFile index(indexName);
+	TileIndexHeader tih;
+	bool useIndex=false;
+	if(index.IsOpen() && index.Size()>=sizeof(TileIndexHeader)){
+		memcpy(&tih,index.Data(),sizeof(TileIndexHeader));
+		useIndex=strcmp(tih.magic,"mapconv tileidx")==0 && tih.version==1 && tih.numTiles==tfh.numTiles
+			&& tih.recordSize==TILE_INDEX_RECORD_HEADER+tih.matchDataSize && tih.matchDataSize>=0
+			&& index.Size()>=sizeof(TileIndexHeader)+(size_t)tih.numTiles*tih.recordSize;
+	}
+	if(useIndex){
+		const char* record=index.Data()+sizeof(TileIndexHeader);
+		for(int a=0;a<tfh.numTiles;++a,record+=tih.recordSize)
+			memcpy(&fastStats[firstTile+a],record+8,sizeof(FastStat));
+	} else {
+		curExternalTiles=tiles;
+		curExternalFirstTile=firstTile;
+		curExternalNumTiles=tfh.numTiles;
+		boost::thread_group threads;
+		for(int t=0;t<numThreads;++t)
+			threads.create_thread(boost::bind(&CTileHandler::CalcExternalStats,this,t));
+		threads.join_all();
+	}
+
+	for(int a=0;a<tfh.numTiles;++a)
+		lazyTiles.push_back(&tiles[(size_t)a*SMALL_TILE_SIZE]);
+	numLazyTiles=(int)lazyTiles.size();
+	lazyMatchData.resize(numLazyTiles);
+	for(int a=0;a<tfh.numTiles;++a)
+		IndexTile(usedTiles++);
+}
+
+void CTileHandler::CalcExternalStats(int thread)
+{
+	unsigned char matchData[TILE_MATCH_SIZE];
+	for(int a=thread;a<curExternalNumTiles;a+=numThreads)
+		CalcCompressedStat((const unsigned char*)&curExternalTiles[(size_t)a*SMALL_TILE_SIZE],8,fastStats[curExternalFirstTile+a],matchData);
+}
+
+const unsigned char* CTileHandler::TileMatchData(int tile,unsigned char* buf)
+{
+	//the external tiles come first and only keep a pointer to their compressed data,
+	//a tile is decoded once when it first becomes a candidate and kept after that
+	if(tile<numLazyTiles){
+		{
+			boost::mutex::scoped_lock lock(lazyMutex);
+			if(!lazyMatchData[tile].empty())
+				return &lazyMatchData[tile][0];
+		}
+		FastStat fs;
+		CalcCompressedStat((const unsigned char*)lazyTiles[tile],8,fs,buf);
+		boost::mutex::scoped_lock lock(lazyMutex);
+		if(lazyMatchData[tile].empty())
+			lazyMatchData[tile].assign(buf,buf+matchDataSize);
+		return &lazyMatchData[tile][0];
+	}
+	return &tileMatchData[(size_t)(tile-numLazyTiles)*matchDataSize];
+}
+
+void CTileHandler::ProcessTiles2(void)
+{
+	unsigned char* data=new unsigned char[1024*1024*4];
+	bigTex=CBitmap(data,1,1);	//free big tex memory
+	int tilex=xsize/4;
+	int tiley=ysize/4;
+	int bigx=tilex/32;
+	int bigy=tiley/32;
+
+	if(numThreads<1)
+		numThreads=1;
+	printf("Processing tiles with %i threads\n", numThreads);
+	squareTiles.resize(1024);
+	SetSquareOrder();
+	//tiles not visited yet are -1 so the cache does not take them as neighbours
+	tileUse.assign(tilex*tiley,neighbourCache ? -1 : 0);
+	cacheLookups=0;
+	cacheHits=0;
+
+	if(clusterTiles>0){
+		ClusterTiles();
+	} else {
+		if(maxNewTiles>0)
+			FitTileBudget();
+		if(!levelFactors.empty())
+			MatchLevels();
+
+		//only the final pass is recorded, not the trials of the tile budget
+		if(!tileStatsName.empty()){
+			SearchStats none={0,0,0};
+			tileSearchStats.assign(tilex*tiley,none);
+			tileMatchError.assign(tilex*tiley,-1);
+			prepareSeconds=0;
+			settleSeconds=0;
+			recordStats=true;
+		}
+		bool streamShards=UseShards() && tileOrder==ORDER_DISCOVERY;
+		if(streamShards)
+			StartShards();
+		for(int a=0;a<bigx*bigy;++a){
+			char bigtile[696320]; //1024x1024 and 4 mipmaps
+			ReadBigSquare(a,bigtile);
+			MatchSquare(a,bigtile);
+			if(streamShards)
+				WriteShards();
+			printf("Creating tiles %i/%i %i%%\n", usedTiles-numExternalTile,(a+1)*1024,(((a+1)*1024)*100)/(tilex*tiley));
+		}
+
+		printf("Found %i exact duplicate tiles\n", numDuplicateTiles);
+		if(neighbourCache)
+			printf("Neighbour cache resolved %i of %i lookups\n", cacheHits, cacheLookups);
+		if(checkLshRecall && tileMatcher==MATCHER_LSH)
+			printf("Lsh matcher found a close tile in %i of %i searches that have one (%.1f%% recall)\n", lshFound, lshSearches, lshSearches>0 ? lshFound*100.0f/lshSearches : 100.0f);
+		if(recordStats){
+			SaveTileStats();
+			recordStats=false;
+		}
+	}
+	squareTiles.clear();
+	//swap to actually free the memory
+	vector<unsigned long long>().swap(cachedHashes);
+	vector<FastStat>().swap(cachedStats);
+	vector<unsigned char>().swap(cachedMatchData);
+
+	delete[] data;
+	if(!rgbaTileIndex.empty() || !streamedSquares.empty()){
+		//the big squares were never written to temp
+		vector<int>().swap(rgbaTileIndex);
+		vector<char>().swap(rgbaTiles);
+		vector<unsigned long long>().swap(rgbaTileHashes);
+		vector<FastStat>().swap(rgbaStats);
+		vector<unsigned char>().swap(rgbaMatchData);
+		vector<char>().swap(streamedSquares);
+		return;
+	}
+#ifdef WIN32
+	if(dxtQuality<0)
+		system("del /q temp*.dds");
+	else
+		system("del /q temp\\Temp*.bmp.raw");
+#else
+	system("rm temp/Temp*.bmp.raw");
+#endif
+}
+
+void CTileHandler::ReadBigSquare(int num,char* bigtile)
+{
+	if(!streamedSquares.empty()){
+		memcpy(bigtile,&streamedSquares[(size_t)num*696320],696320);
+		return;
+	}
+	if(!rgbaTileIndex.empty()){
+		for(int b=0;b<1024;++b)
+			WriteTile((b%32)*32,(b/32)*32,&rgbaTiles[(size_t)rgbaTileIndex[num*1024+b]*SMALL_TILE_SIZE],bigtile);
+		return;
+	}
+	char name[100];
+#ifdef WIN32
+	if(dxtQuality<0){
+		DDSURFACEDESC2 ddsheader;
+		int ddssignature;
+		sprintf(name,"Temp%03i.dds",num);
+		CFileHandler file(name);
+		file.Read(&ddssignature, sizeof(int));
+		file.Read(&ddsheader, sizeof(DDSURFACEDESC2));
+		file.Read(bigtile, 696320);
+		return;
+	}
+#endif
+	//the built in compressor writes the raw files on every platform
+	snprintf(name, 100, "temp/Temp%03i.bmp.raw", num);
+	CFileHandler file(name);
+	file.Read(bigtile, 696320);
+}
+
+//moves tile to the front of the recently matched tiles
+static void RememberTile(int* recent,int& numRecent,int tile)
+{
+	int a=0;
+	while(a<numRecent && recent[a]!=tile)
+		++a;
+	if(a==numRecent && numRecent<TILE_CACHE_SIZE)
+		numRecent++;
+	for(a=min(a,numRecent-1);a>0;--a)
+		recent[a]=recent[a-1];
+	recent[0]=tile;
+}
+
+//point d along a hilbert curve over a size*size grid, size a power of two
+static void HilbertPoint(int size,int d,int& x,int& y)
+{
+	x=0;
+	y=0;
+	for(int s=1,t=d;s<size;s*=2,t/=4){
+		int rx=1&(t/2);
+		int ry=1&(t^rx);
+		if(ry==0){
+			if(rx==1){
+				x=s-1-x;
+				y=s-1-y;
+			}
+			swap(x,y);
+		}
+		x+=s*rx;
+		y+=s*ry;
+	}
+}
+
+//point d along a morton curve, the even bits of d are x and the odd bits y
+static void MortonPoint(int d,int& x,int& y)
+{
+	x=0;
+	y=0;
+	for(int b=0;d>>(2*b);++b){
+		x|=((d>>(2*b))&1)<<b;
+		y|=((d>>(2*b+1))&1)<<b;
+	}
+}
+
+void CTileHandler::SetSquareOrder(void)
+{
+	squareOrder.resize(1024);
+	for(int d=0;d<1024;++d){
+		if(!neighbourCache){
+			squareOrder[d]=d;
+			continue;
+		}
+		//hilbert curve over the 32x32 tiles, so tiles close in the order are close on the map
+		int x,y;
+		HilbertPoint(32,d,x,y);
+		squareOrder[d]=y*32+x;
+	}
+}
+
+int CTileHandler::ProbeTileCache(const FastStat& fs,const unsigned char* data,const int* cache,int cacheSize,int forbidden,int startTile,int endTile,const Thresholds& th,SearchStats* stats)
+{
+	//returns the first cached tile in [startTile,endTile) other than forbidden that is close enough
+	if(meanThreshold<=0 || th.mean<=0)
+		return -1;
+	unsigned char buf[TILE_MATCH_SIZE];
+	for(int a=0;a<cacheSize;++a){
+		int t=cache[a];
+		if(t<startTile || t>=endTile || t==forbidden)
+			continue;
+		if(stats)
+			stats->candidates++;
+		if(!CompareFastStat(fs,fastStats[t],th)){
+			if(stats)
+				stats->rejected++;
+			continue;
+		}
+		if(stats)
+			stats->compares++;
+		if(CompareTiles(data,TileMatchData(t,buf),th))
+			return t;
+	}
+	return -1;
+}
+
+void CTileHandler::MatchSquare(int num,char* bigtile)
+{
+	//bigtile can be 0 when the signatures are cached and only the number of new tiles is wanted
+	int tilex=xsize/4;
+	int startTilex=(num%(tilex/32))*32;
+	int startTiley=(num/(tilex/32))*32;
+
+	//decode the tiles and match them against the tiles from earlier squares on all threads
+	curBigTile=bigtile;
+	curSquare=num;
+	squareStartTile=usedTiles;
+	boost::posix_time::ptime start;
+	if(recordStats)
+		start=boost::posix_time::microsec_clock::universal_time();
+	if((int)searchCandidates.size()<numThreads)
+		searchCandidates.resize(numThreads);
+	boost::thread_group workers;
+	for(int t=1;t<numThreads;++t)
+		workers.create_thread(boost::bind(&CTileHandler::PrepareSquareTiles,this,t));
+	PrepareSquareTiles(0);
+	workers.join_all();
+	if(recordStats){
+		boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+		prepareSeconds+=(now-start).total_microseconds()/1e6;
+		start=now;
+	}
+
+	//then settle them in visiting order so the result does not depend on the number of threads
+	int recent[TILE_CACHE_SIZE];
+	int numRecent=0;
+	for(int i=0;i<1024;++i){
+		int b=squareOrder[i];
+		int x=b%32;
+		int y=b/32;
+		int xb=startTilex+x; //curr pointer to tile in bigtex
+		int yb=startTiley+y;
+		SquareTile& st=squareTiles[b];
+		if(st.cacheLookup){
+			cacheLookups++;
+			if(st.cached)
+				cacheHits++;
+		}
+
+		int t1=tileUse[max(0,(yb-1)*tilex+xb)];
+		int t2=tileUse[max(0,yb*tilex+xb-1)];
+		int forbidden=t1==t2?t1:-1;
+		Thresholds th=ScaledThresholds(st.level);
+
+		//a tile with the same compressed data as an earlier one gets the same result
+		//unless that result or a tile skipped when finding it is now forbidden, or it
+		//was found with other thresholds
+		bool useHash=meanThreshold>0 && meanDirThreshold>0 && matchThreshold>=0;
+		if(useHash){
+			map<unsigned long long,DuplicateTile>::iterator di=duplicateTiles.find(st.hash);
+			if(di!=duplicateTiles.end() && di->second.tile!=forbidden
+			&& (di->second.skipped==-1 || di->second.skipped==forbidden)
+			&& (di->second.level==-1 || di->second.level==st.level)){
+				tileUse[yb*tilex+xb]=di->second.tile;
+				numDuplicateTiles++;
+				if(recordStats)
+					RecordTileStats(b,yb*tilex+xb,di->second.tile,false);
+				if(neighbourCache)
+					RememberTile(recent,numRecent,di->second.tile);
+				continue;
+			}
+		}
+
+		if(!st.decoded)
+			DecodeSquareTile(b);
+
+		SearchStats* stats=recordStats ? &st.stats : 0;
+		int ct=-1;
+		if(st.match>=0 && st.match!=forbidden){
+			ct=st.match;
+		} else if(neighbourCache){
+			//tiles already placed around this one, then the last matches in this square
+			int cache[TILE_CACHE_SIZE+8];
+			int cacheSize=0;
+			for(int dy=-1;dy<=1;++dy){
+				for(int dx=-1;dx<=1;++dx){
+					if((dx==0 && dy==0) || xb+dx<0 || xb+dx>=tilex || yb+dy<0 || yb+dy>=ysize/4)
+						continue;
+					int t=tileUse[(yb+dy)*tilex+xb+dx];
+					if(t>=0)
+						cache[cacheSize++]=t;
+				}
+			}
+			for(int r=0;r<numRecent;++r)
+				cache[cacheSize++]=recent[r];
+			ct=ProbeTileCache(st.fs,st.matchData,cache,cacheSize,forbidden,st.match==-1 ? squareStartTile : 0,usedTiles,th,stats);
+			cacheLookups++;
+			if(ct!=-1)
+				cacheHits++;
+		}
+
+		if(ct==-1 && st.match==-2)
+			ct=FindCloseTile(st.fs,st.matchData,forbidden,0,usedTiles,th,stats,searchCandidates[0]);
+		else if(ct==-1 && st.match==-1)
+			ct=FindCloseTile(st.fs,st.matchData,forbidden,squareStartTile,usedTiles,th,stats,searchCandidates[0]);
+		else if(ct==-1)
+			ct=FindCloseTile(st.fs,st.matchData,forbidden,st.cached ? 0 : st.match+1,usedTiles,th,stats,searchCandidates[0]);
+
+		bool isNew=ct==-1;
+		if(ct==-1){
+			if(bigtile){
+				newTiles.resize(newTiles.size()+SMALL_TILE_SIZE);
+				ReadTile(x*32,y*32,&newTiles[newTiles.size()-SMALL_TILE_SIZE],bigtile);
+			}
+			ct=AddTile(st.fs,st.matchData);
+		}
+		tileUse[yb*tilex+xb]=ct;
+		if(recordStats)
+			RecordTileStats(b,yb*tilex+xb,ct,isNew);
+		if(neighbourCache)
+			RememberTile(recent,numRecent,ct);
+		if(useHash){
+			DuplicateTile& dt=duplicateTiles[st.hash];
+			dt.tile=ct;
+			dt.skipped=(forbidden>=0 && forbidden<ct)?forbidden:-1;
+			dt.level=st.level;
+		}
+	}
+	if(recordStats)
+		settleSeconds+=(boost::posix_time::microsec_clock::universal_time()-start).total_microseconds()/1e6;
+}
+
+void CTileHandler::RecordTileStats(int b,int index,int tile,bool isNew)
+{
+	SquareTile& st=squareTiles[b];
+	tileSearchStats[index]=st.stats;
+	if(isNew){
+		tileMatchError[index]=-1;
+		return;
+	}
+	if(!st.decoded)
+		DecodeSquareTile(b);
+	unsigned char buf[TILE_MATCH_SIZE];
+	tileMatchError[index]=TileError(st.matchData,TileMatchData(tile,buf));
+}
+
+void CTileHandler::SaveTileStats(void)
+{
+	int tilex=xsize/4;
+	int tiley=ysize/4;
+	int numTiles=tilex*tiley;
+
+	long long candidates=0;
+	long long rejected=0;
+	long long compares=0;
+	int maxCost=0;
+	int matched=0;
+	int zeroError=0;
+	long long totalError=0;
+	int maxError=0;
+	int histogram[TILE_STATS_BUCKETS];
+	for(int a=0;a<TILE_STATS_BUCKETS;++a)
+		histogram[a]=0;
+	for(int a=0;a<numTiles;++a){
+		const SearchStats& ss=tileSearchStats[a];
+		candidates+=ss.candidates;
+		rejected+=ss.rejected;
+		compares+=ss.compares;
+		maxCost=max(maxCost,ss.candidates+ss.compares);
+		int error=tileMatchError[a];
+		if(error<0)
+			continue;
+		matched++;
+		totalError+=error;
+		maxError=max(maxError,error);
+		if(error==0)
+			zeroError++;
+		else
+			histogram[matchThreshold>0 ? min(TILE_STATS_BUCKETS-1,(int)((long long)error*TILE_STATS_BUCKETS/matchThreshold)) : TILE_STATS_BUCKETS-1]++;
+	}
+
+	//red is the error of the tile used relative to the threshold, green the lookup cost on a log
+	//scale and blue marks new tiles
+	vector<unsigned char> heat((size_t)numTiles*4);
+	for(int a=0;a<numTiles;++a){
+		int error=tileMatchError[a];
+		int cost=tileSearchStats[a].candidates+tileSearchStats[a].compares;
+		heat[a*4+0]=error<=0 ? 0 : (matchThreshold>0 ? (unsigned char)min(255LL,(long long)error*255/matchThreshold) : 255);
+		heat[a*4+1]=maxCost>0 ? (unsigned char)(log(1.0+cost)*255/log(1.0+maxCost)) : 0;
+		heat[a*4+2]=error<0 ? 255 : 0;
+		heat[a*4+3]=255;
+	}
+	CBitmap heatmap(&heat[0],tilex,tiley);
+	heatmap.Save(tileStatsName+".tga");
+
+	FILE* f=fopen((tileStatsName+".json").c_str(),"w");
+	if(!f){
+		printf("Couldnt write tile stats %s.json\n",tileStatsName.c_str());
+		return;
+	}
+	fprintf(f,"{\n");
+	fprintf(f,"  \"tiles\": %i,\n",numTiles);
+	fprintf(f,"  \"newTiles\": %i,\n",usedTiles-numExternalTile);
+	fprintf(f,"  \"exactDuplicates\": %i,\n",numDuplicateTiles);
+	fprintf(f,"  \"matchedTiles\": %i,\n",matched);
+	fprintf(f,"  \"candidates\": %lld,\n",candidates);
+	fprintf(f,"  \"prefilterRejected\": %lld,\n",rejected);
+	fprintf(f,"  \"compareTiles\": %lld,\n",compares);
+	fprintf(f,"  \"cacheLookups\": %i,\n",cacheLookups);
+	fprintf(f,"  \"cacheHits\": %i,\n",cacheHits);
+	fprintf(f,"  \"matchThreshold\": %i,\n",matchThreshold);
+	fprintf(f,"  \"meanMatchError\": %.1f,\n",matched>0 ? (double)totalError/matched : 0.0);
+	fprintf(f,"  \"maxMatchError\": %i,\n",maxError);
+	fprintf(f,"  \"zeroErrorMatches\": %i,\n",zeroError);
+	fprintf(f,"  \"errorHistogram\": [");
+	for(int a=0;a<TILE_STATS_BUCKETS;++a)
+		fprintf(f,"%s%i",a>0 ? ", " : "",histogram[a]);
+	fprintf(f,"],\n");
+	fprintf(f,"  \"prepareSeconds\": %.3f,\n",prepareSeconds);
+	fprintf(f,"  \"settleSeconds\": %.3f\n",settleSeconds);
+	fprintf(f,"}\n");
+	fclose(f);
+	printf("Wrote tile stats to %s.tga and %s.json\n",tileStatsName.c_str(),tileStatsName.c_str());
+}
+
+void CTileHandler::MatchLevels(void)
+{
+	//the tiles are decoded once and matched again for each factor, the results are kept until
+	//UseLevel puts them back for saving, then the main factor is matched as usual
+	if(!tileLibrary.empty()){
+		printf("Extra compress factors are not used with a tile library\n");
+		return;
+	}
+	if(cachedStats.empty())
+		CacheSignatures();
+
+	float mainFactor=compressFactor;
+	int numSquares=(xsize/128)*(ysize/128);
+	tileLevels.resize(levelFactors.size());
+	for(size_t l=0;l<levelFactors.size();++l){
+		SetCompressFactor(levelFactors[l]);
+		ResetTiles();
+		for(int a=0;a<numSquares;++a){
+			char bigtile[696320];
+			ReadBigSquare(a,bigtile);
+			MatchSquare(a,bigtile);
+		}
+		TileLevel& tl=tileLevels[l];
+		tl.compressFactor=levelFactors[l];
+		tl.usedTiles=usedTiles;
+		tl.tileUse=tileUse;
+		tl.newTiles.swap(newTiles);
+		printf("Compress factor %.3f gives %i tiles\n",levelFactors[l],usedTiles-numExternalTile);
+	}
+	SetCompressFactor(mainFactor);
+	ResetTiles();
+}
+
+void CTileHandler::UseLevel(int level)
+{
+	//makes SaveData write the tiles matched with levelFactors[level]
+	TileLevel& tl=tileLevels[level];
+	SetCompressFactor(tl.compressFactor);
+	usedTiles=tl.usedTiles;
+	tileUse.swap(tl.tileUse);
+	newTiles.swap(tl.newTiles);
+}
+
+void CTileHandler::FitTileBudget(void)
+{
+	//decode every tile once, each trial factor then only has to redo the matching
+	CacheSignatures();
+
+	printf("Searching for a compress factor giving at most %i tiles\n", maxNewTiles);
+	float low=0;			//largest factor known to give too many tiles
+	float high=-1;			//smallest factor known to fit the budget
+	float factor=max(compressFactor,MIN_COMPRESS_FACTOR);
+	for(int trial=0;trial<24;++trial){
+		int numTiles=CountNewTiles(factor);
+		if(numTiles<=maxNewTiles){
+			printf("Compress factor %.3f gives %i tiles\n", factor, numTiles);
+			high=factor;
+		} else {
+			printf("Compress factor %.3f gives more than %i tiles\n", factor, maxNewTiles);
+			low=factor;
+		}
+		if(high<0){
+			if(low>=MAX_COMPRESS_FACTOR)
+				break;
+			factor=min(low*2,MAX_COMPRESS_FACTOR);
+		} else if(high-low<=high*0.01f || (low==0 && high<=MIN_COMPRESS_FACTOR)){
+			break;
+		} else if(low==0){
+			factor=max(high/2,MIN_COMPRESS_FACTOR);
+		} else {
+			factor=(low+high)/2;
+		}
+	}
+	if(high<0){
+		printf("Tile budget can not be reached, using compress factor %.3f\n", low);
+		high=low;
+	}
+	printf("Using compress factor %.3f\n", high);
+	SetCompressFactor(high);
+	ResetTiles();
+}
+
+void CTileHandler::CacheSignatures(void)
+{
+	int numSquares=(xsize/128)*(ysize/128);
+	cachedHashes.resize(numSquares*1024);
+	cachedStats.resize(numSquares*1024);
+	cachedMatchData.resize((size_t)numSquares*1024*matchDataSize);
+
+	for(int a=0;a<numSquares;++a){
+		char bigtile[696320];
+		ReadBigSquare(a,bigtile);
+		curBigTile=bigtile;
+		curSquare=a;
+		boost::thread_group workers;
+		for(int t=1;t<numThreads;++t)
+			workers.create_thread(boost::bind(&CTileHandler::CacheSquareSignatures,this,t));
+		CacheSquareSignatures(0);
+		workers.join_all();
+		printf("Caching tile signatures %i%%\n", ((a+1)*100)/numSquares);
+	}
+}
+
+void CTileHandler::CacheSquareSignatures(int thread)
+{
+	for(int b=thread;b<1024;b+=numThreads){
+		int n=curSquare*1024+b;
+		if(!rgbaTileIndex.empty()){
+			int u=rgbaTileIndex[n];
+			cachedHashes[n]=rgbaTileHashes[u];
+			cachedStats[n]=rgbaStats[u];
+			memcpy(&cachedMatchData[(size_t)n*matchDataSize],&rgbaMatchData[(size_t)u*matchDataSize],matchDataSize);
+			continue;
+		}
+		cachedHashes[n]=HashTile((b%32)*32,(b/32)*32,curBigTile);
+		CalcCompressedStat((unsigned char*)&curBigTile[((b%32)*8+(b/32)*8*256)*8],256,cachedStats[n],&cachedMatchData[(size_t)n*matchDataSize]);
+	}
+}
+
+int CTileHandler::CountNewTiles(float compressFactor)
+{
+	//runs the matching on the cached signatures, stops early once the budget is exceeded
+	SetCompressFactor(compressFactor);
+	ResetTiles();
+	int numSquares=(xsize/128)*(ysize/128);
+	for(int a=0;a<numSquares && usedTiles-numExternalTile<=maxNewTiles;++a)
+		MatchSquare(a,0);
+	return usedTiles-numExternalTile;
+}
+
+void CTileHandler::ResetTiles(void)
+{
+	//forget the tiles of an earlier pass but keep the external ones, indexed for the current thresholds
+	usedTiles=numExternalTile;
+	fastStats.resize(numExternalTile);
+	tileMatchData.resize((size_t)(numExternalTile-numLazyTiles)*matchDataSize);
+	statIndex.clear();
+	for(int t=0;t<LSH_TABLES;++t)
+		lshTables[t].clear();
+	for(int a=0;a<numExternalTile;++a)
+		IndexTile(a);
+	duplicateTiles.clear();
+	AddLibraryDuplicates();
+	numDuplicateTiles=0;
+	lshSearches=0;
+	lshFound=0;
+	cacheLookups=0;
+	cacheHits=0;
+	newTiles.clear();
+	tileUse.assign(tileUse.size(),neighbourCache ? -1 : 0);
+}
+
+static inline unsigned int NextRandom(unsigned int& seed)
+{
+	//fixed seed lcg so a map clusters the same way every run
+	seed=seed*1103515245+12345;
+	return seed>>8;
+}
+
+void CTileHandler::ClusterTiles(void)
+{
+	int tilex=xsize/4;
+	int numSquares=(xsize/128)*(ysize/128);
+	int numTiles=numSquares*1024;
+
+	//hash and block colours of every tile, exact duplicates become one distinct tile
+	clusterHashes.resize(numTiles);
+	clusterTileDistinct.resize(numTiles);
+	clusterFirstTile.clear();
+	clusterFeatures.clear();
+	squareFeatures.resize(1024*TILE_FEATURE_SIZE);
+	map<unsigned long long,int> distinct;
+	for(int a=0;a<numSquares;++a){
+		char bigtile[696320];
+		ReadBigSquare(a,bigtile);
+		curBigTile=bigtile;
+		curSquare=a;
+		boost::thread_group workers;
+		for(int t=1;t<numThreads;++t)
+			workers.create_thread(boost::bind(&CTileHandler::CacheSquareFeatures,this,t));
+		CacheSquareFeatures(0);
+		workers.join_all();
+
+		for(int b=0;b<1024;++b){
+			int n=a*1024+b;
+			map<unsigned long long,int>::iterator di=distinct.find(clusterHashes[n]);
+			if(di==distinct.end()){
+				di=distinct.insert(make_pair(clusterHashes[n],(int)clusterFirstTile.size())).first;
+				clusterFirstTile.push_back(n);
+				clusterFeatures.insert(clusterFeatures.end(),&squareFeatures[b*TILE_FEATURE_SIZE],&squareFeatures[(b+1)*TILE_FEATURE_SIZE]);
+			}
+			clusterTileDistinct[n]=di->second;
+		}
+		printf("Reading tile colours %i%%\n", ((a+1)*100)/numSquares);
+	}
+	int numDistinct=(int)clusterFirstTile.size();
+	int numClusters=min(clusterTiles,numDistinct);
+	printf("Clustering %i distinct tiles into %i tiles\n", numDistinct, numClusters);
+
+	//start from randomly picked distinct tiles
+	unsigned int seed=12345;
+	vector<int> pick(numDistinct);
+	for(int i=0;i<numDistinct;++i)
+		pick[i]=i;
+	if(numClusters<numDistinct){
+		for(int i=0;i<numClusters;++i)
+			swap(pick[i],pick[i+NextRandom(seed)%(numDistinct-i)]);
+	}
+	clusterCenters.resize((size_t)numClusters*TILE_FEATURE_SIZE);
+	for(int c=0;c<numClusters;++c){
+		for(int k=0;k<TILE_FEATURE_SIZE;++k)
+			clusterCenters[(size_t)c*TILE_FEATURE_SIZE+k]=clusterFeatures[(size_t)pick[c]*TILE_FEATURE_SIZE+k];
+	}
+
+	//mini batch k-means, tiles are sampled from the whole map so often repeated tiles weigh
+	//more, each centre moves towards its tiles by one over the number of tiles it has seen
+	if(numClusters<numDistinct){
+		vector<int> centerCount(numClusters,1);
+		int batchSize=min(CLUSTER_BATCH_SIZE,numTiles);
+		for(int iter=0;iter<CLUSTER_ITERATIONS;++iter){
+			SortCenters();
+			clusterPoints.resize(batchSize);
+			for(int i=0;i<batchSize;++i)
+				clusterPoints[i]=clusterTileDistinct[NextRandom(seed)%numTiles];
+			pointCluster.resize(batchSize);
+			pointDist.resize(batchSize);
+			boost::thread_group workers;
+			for(int t=1;t<numThreads;++t)
+				workers.create_thread(boost::bind(&CTileHandler::AssignClusterPoints,this,t));
+			AssignClusterPoints(0);
+			workers.join_all();
+
+			for(int i=0;i<batchSize;++i){
+				int c=pointCluster[i];
+				float eta=1.0f/(++centerCount[c]);
+				float* center=&clusterCenters[(size_t)c*TILE_FEATURE_SIZE];
+				const unsigned char* feature=&clusterFeatures[(size_t)clusterPoints[i]*TILE_FEATURE_SIZE];
+				for(int k=0;k<TILE_FEATURE_SIZE;++k)
+					center[k]+=(feature[k]-center[k])*eta;
+			}
+			printf("Clustering tiles %i%%\n", ((iter+1)*100)/CLUSTER_ITERATIONS);
+		}
+	}
+
+	//final assignment of every distinct tile
+	SortCenters();
+	clusterPoints.resize(numDistinct);
+	for(int i=0;i<numDistinct;++i)
+		clusterPoints[i]=i;
+	pointCluster.resize(numDistinct);
+	pointDist.resize(numDistinct);
+	boost::thread_group workers;
+	for(int t=1;t<numThreads;++t)
+		workers.create_thread(boost::bind(&CTileHandler::AssignClusterPoints,this,t));
+	AssignClusterPoints(0);
+	workers.join_all();
+
+	//clusters left without tiles take over the tiles furthest from their centres,
+	//so there are always exactly numClusters tiles
+	vector<int> members(numClusters,0);
+	for(int i=0;i<numDistinct;++i)
+		members[pointCluster[i]]++;
+	vector<int> emptyClusters;
+	for(int c=0;c<numClusters;++c){
+		if(members[c]==0)
+			emptyClusters.push_back(c);
+	}
+	if(!emptyClusters.empty()){
+		vector<pair<float,int> > far(numDistinct);
+		for(int i=0;i<numDistinct;++i)
+			far[i]=make_pair(-pointDist[i],i);
+		sort(far.begin(),far.end());
+		size_t e=0;
+		for(int i=0;i<numDistinct && e<emptyClusters.size();++i){
+			int p=far[i].second;
+			if(members[pointCluster[p]]<=1)
+				continue;
+			members[pointCluster[p]]--;
+			pointCluster[p]=emptyClusters[e++];
+			pointDist[p]=0;
+		}
+	}
+
+	//the tile of each cluster closest to its centre represents it, output in scan order
+	vector<int> medoid(numClusters,-1);
+	for(int i=0;i<numDistinct;++i){
+		int c=pointCluster[i];
+		if(medoid[c]==-1 || pointDist[i]<pointDist[medoid[c]])
+			medoid[c]=i;
+	}
+	vector<pair<int,int> > order(numClusters);
+	for(int c=0;c<numClusters;++c)
+		order[c]=make_pair(clusterFirstTile[medoid[c]],c);
+	sort(order.begin(),order.end());
+	vector<int> clusterTile(numClusters);
+	for(int r=0;r<numClusters;++r)
+		clusterTile[order[r].second]=numExternalTile+r;
+
+	for(int n=0;n<numTiles;++n){
+		int a=n/1024;
+		int b=n%1024;
+		int xb=(a%(tilex/32))*32+b%32;
+		int yb=(a/(tilex/32))*32+b/32;
+		tileUse[yb*tilex+xb]=clusterTile[pointCluster[clusterTileDistinct[n]]];
+	}
+
+	newTiles.resize((size_t)numClusters*SMALL_TILE_SIZE);
+	int loadedSquare=-1;
+	char bigtile[696320];
+	for(int r=0;r<numClusters;++r){
+		int n=order[r].first;
+		if(n/1024!=loadedSquare){
+			loadedSquare=n/1024;
+			ReadBigSquare(loadedSquare,bigtile);
+		}
+		ReadTile(((n%1024)%32)*32,((n%1024)/32)*32,&newTiles[(size_t)r*SMALL_TILE_SIZE],bigtile);
+	}
+	usedTiles=numExternalTile+numClusters;
+
+	//swap to actually free the memory
+	vector<unsigned long long>().swap(clusterHashes);
+	vector<int>().swap(clusterFirstTile);
+	vector<int>().swap(clusterTileDistinct);
+	vector<unsigned char>().swap(clusterFeatures);
+	vector<unsigned char>().swap(squareFeatures);
+	vector<float>().swap(clusterCenters);
+	vector<int>().swap(clusterPoints);
+	vector<int>().swap(pointCluster);
+	vector<float>().swap(pointDist);
+}
+
+void CTileHandler::CacheSquareFeatures(int thread)
+{
+	for(int b=thread;b<1024;b+=numThreads){
+		clusterHashes[curSquare*1024+b]=HashTile((b%32)*32,(b/32)*32,curBigTile);
+		CalcBlockFeature((unsigned char*)&curBigTile[((b%32)*8+(b/32)*8*256)*8],256,&squareFeatures[b*TILE_FEATURE_SIZE]);
+	}
+}
+
+//rgb sums of the four 4x4 block quadrants of a feature
+template<class T> static void QuadrantSums(const T* feature,float* quads)
+{
+	for(int q=0;q<12;++q)
+		quads[q]=0;
+	for(int by=0;by<8;++by){
+		for(int bx=0;bx<8;++bx){
+			float* quad=&quads[((by/4)*2+bx/4)*3];
+			for(int c=0;c<3;++c)
+				quad[c]+=feature[(by*8+bx)*3+c];
+		}
+	}
+}
+
+void CTileHandler::SortCenters(void)
+{
+	int numCenters=(int)(clusterCenters.size()/TILE_FEATURE_SIZE);
+	vector<pair<float,int> > sums(numCenters);
+	for(int c=0;c<numCenters;++c){
+		float sum=0;
+		for(int k=0;k<TILE_FEATURE_SIZE;++k)
+			sum+=clusterCenters[(size_t)c*TILE_FEATURE_SIZE+k];
+		sums[c]=make_pair(sum,c);
+	}
+	sort(sums.begin(),sums.end());
+	centerOrder.resize(numCenters);
+	centerSums.resize(numCenters);
+	centerQuads.resize(numCenters*12);
+	for(int i=0;i<numCenters;++i){
+		centerSums[i]=sums[i].first;
+		centerOrder[i]=sums[i].second;
+		QuadrantSums(&clusterCenters[(size_t)centerOrder[i]*TILE_FEATURE_SIZE],&centerQuads[i*12]);
+	}
+}
+
+int CTileHandler::NearestCenter(const unsigned char* feature,float& bestDist)
+{
+	//the squared distance of two features is at least the squared difference of the sums of any
+	//n of their components divided by n. Walk outwards from the tile's total in centre total order
+	//until that bound is too large, and skip centres whose quadrant sums already rule them out
+	float sum=0;
+	for(int k=0;k<TILE_FEATURE_SIZE;++k)
+		sum+=feature[k];
+	float quads[12];
+	QuadrantSums(feature,quads);
+
+	int numCenters=(int)centerOrder.size();
+	int up=(int)(lower_bound(centerSums.begin(),centerSums.end(),sum)-centerSums.begin());
+	int down=up-1;
+	int best=-1;
+	bestDist=FLT_MAX;
+	while(up<numCenters || down>=0){
+		int i;
+		if(down<0 || (up<numCenters && centerSums[up]-sum<sum-centerSums[down]))
+			i=up++;
+		else
+			i=down--;
+		float d=centerSums[i]-sum;
+		if(d*d>=bestDist*TILE_FEATURE_SIZE)
+			break;		//the other side is further away still
+
+		float bound=0;
+		const float* centerQuad=&centerQuads[i*12];
+		for(int q=0;q<12;++q){
+			float dif=quads[q]-centerQuad[q];
+			bound+=dif*dif;
+		}
+		if(bound>=bestDist*16)
+			continue;
+
+		const float* center=&clusterCenters[(size_t)centerOrder[i]*TILE_FEATURE_SIZE];
+		float dist=0;
+		for(int k=0;k<TILE_FEATURE_SIZE && dist<bestDist;k+=48){
+			for(int j=k;j<k+48;++j){
+				float dif=feature[j]-center[j];
+				dist+=dif*dif;
+			}
+		}
+		if(dist<bestDist){
+			bestDist=dist;
+			best=centerOrder[i];
+		}
+	}
+	return best;
+}
+
+void CTileHandler::AssignClusterPoints(int thread)
+{
+	for(int i=thread;i<(int)clusterPoints.size();i+=numThreads)
+		pointCluster[i]=NearestCenter(&clusterFeatures[(size_t)clusterPoints[i]*TILE_FEATURE_SIZE],pointDist[i]);
+}
+
+void CTileHandler::SaveData(ofstream& ofs)
+{
+	if(tileOrder!=ORDER_DISCOVERY)
+		OrderNewTiles();
+
+	//write tile header
+	MapTileHeader mth;
+	mth.numTileFiles=(int)externalFiles.size()+(UseShards() ? numShards : 1);
+	mth.numTiles=usedTiles;
+	ofs.write((char*)&mth,sizeof(MapTileHeader));
+
+	//write external tile files used
+	for(int fileNum=0;fileNum<(int)externalFiles.size();++fileNum){
+		ofs.write((char*)&externalFileTileSize[fileNum],4);
+		ofs.write(externalFiles[fileNum].c_str(),externalFiles[fileNum].size()+1);
+	}
+	//write new tile files to be created, or the library the new tiles are appended to
+	int internalTiles=usedTiles-numExternalTile;
+	if(UseShards()){
+		FinishShards();
+		for(int k=0;k<numShards;++k){
+			int shardTiles=shardOffsets[k+1]-shardOffsets[k];
+			string name=ShardFileName(k);
+			ofs.write((char*)&shardTiles,4);
+			ofs.write(name.c_str(),name.size()+1);
+		}
+	} else {
+		int myTiles=numLibraryTiles+internalTiles;
+		ofs.write((char*)&myTiles,4);
+		ofs.write(myTileFile.c_str(),myTileFile.size()+1);
+	}
+
+	//write tiles
+	for(int y=0; y<ysize/4; y++){
+		for(int x=0; x<xsize/4; x++){
+			int num = tileUse[x+y*xsize/4];
+			ofs.write((char*)&num, sizeof(int));
+		}
+	}
+
+	if(UseShards()){
+		newTiles.clear();
+		return;
+	}
+
+	if(!tileLibrary.empty()){
+		AppendToTileLibrary();
+		newTiles.clear();
+		return;
+	}
+
+	//create new tile file
+
+	ofstream tf(myTileFile.c_str(),ios::binary | ios::out);
+
+	TileFileHeader tfh;
+	strcpy(tfh.magic,"spring tilefile");
+	tfh.version=1;
+	tfh.tileSize=32;
+	tfh.compressionType=1;
+	tfh.numTiles=internalTiles;
+
+	tf.write((char*)&tfh,sizeof(TileFileHeader));
+
+	if(internalTiles>0)
+		tf.write(&newTiles[0],internalTiles*SMALL_TILE_SIZE);
+	newTiles.clear();
+}
+
+void CTileHandler::OrderNewTiles(void)
+{
+	//renumber the new tiles by their first use along the curve so a region of the map uses
+	//a few runs of the tile file instead of tiles spread over all of it
+	int tilex=xsize/4;
+	int tiley=ysize/4;
+	int size=1;
+	while(size<tilex || size<tiley)
+		size*=2;
+
+	int internalTiles=usedTiles-numExternalTile;
+	vector<int> newNumber(internalTiles,-1);
+	int numOrdered=0;
+	for(int d=0;d<size*size;++d){
+		int x,y;
+		if(tileOrder==ORDER_HILBERT)
+			HilbertPoint(size,d,x,y);
+		else
+			MortonPoint(d,x,y);
+		if(x>=tilex || y>=tiley)
+			continue;
+		int t=tileUse[y*tilex+x]-numExternalTile;
+		if(t>=0 && newNumber[t]==-1)
+			newNumber[t]=numOrdered++;
+	}
+	//tiles no map tile uses anymore keep their relative order at the end
+	for(int t=0;t<internalTiles;++t){
+		if(newNumber[t]==-1)
+			newNumber[t]=numOrdered++;
+	}
+
+	vector<char> ordered(newTiles.size());
+	for(int t=0;t<internalTiles;++t)
+		memcpy(&ordered[(size_t)newNumber[t]*SMALL_TILE_SIZE],&newTiles[(size_t)t*SMALL_TILE_SIZE],SMALL_TILE_SIZE);
+	newTiles.swap(ordered);
+	for(vector<int>::iterator ui=tileUse.begin();ui!=tileUse.end();++ui){
+		if(*ui>=numExternalTile)
+			*ui=numExternalTile+newNumber[*ui-numExternalTile];
+	}
+}
+
+void CTileHandler::BenchmarkTileReads(int numViews)
+{
+	//reads the new tiles of random rectangles of the map from the saved tile file, one read per
+	//run of consecutive tiles, like an engine streaming the tiles of what it looks at
+	string file=tileLibrary.empty() ? myTileFile : tileLibrary;
+	int firstTile=numExternalTile-numLibraryTiles;
+	vector<string> files;
+	vector<int> fileFirst;		//first tile of each file, then the end
+	if(UseShards()){
+		for(int k=0;k<numShards;++k)
+			files.push_back(ShardFileName(k));
+		fileFirst=shardOffsets;
+		file=ShardFileName(0)+"...";
+	} else {
+		files.push_back(file);
+		fileFirst.push_back(0);
+		fileFirst.push_back(INT_MAX);
+	}
+	vector<ifstream*> streams;
+	for(size_t f=0;f<files.size();++f){
+		streams.push_back(new ifstream(files[f].c_str(),ios::in | ios::binary));
+		if(!streams.back()->is_open()){
+			printf("Couldnt open tile file %s\n",files[f].c_str());
+			for(size_t g=0;g<streams.size();++g)
+				delete streams[g];
+			return;
+		}
+	}
+	int tilex=xsize/4;
+	int tiley=ysize/4;
+	unsigned int seed=1;
+	vector<int> viewTiles;
+	vector<char> buf;
+	long long numTiles=0;
+	long long numRuns=0;
+	long long spanned=0;
+	boost::posix_time::ptime start=boost::posix_time::microsec_clock::universal_time();
+	for(int v=0;v<numViews;++v){
+		int w=min(tilex,TILE_BENCH_MIN_VIEW+(int)(NextRandom(seed)%(TILE_BENCH_MAX_VIEW-TILE_BENCH_MIN_VIEW+1)));
+		int h=min(tiley,TILE_BENCH_MIN_VIEW+(int)(NextRandom(seed)%(TILE_BENCH_MAX_VIEW-TILE_BENCH_MIN_VIEW+1)));
+		int x0=NextRandom(seed)%(tilex-w+1);
+		int y0=NextRandom(seed)%(tiley-h+1);
+		viewTiles.clear();
+		for(int y=y0;y<y0+h;++y){
+			for(int x=x0;x<x0+w;++x){
+				int t=tileUse[y*tilex+x];
+				if(t>=firstTile)
+					viewTiles.push_back(t-firstTile);
+			}
+		}
+		sort(viewTiles.begin(),viewTiles.end());
+		viewTiles.erase(unique(viewTiles.begin(),viewTiles.end()),viewTiles.end());
+		if(viewTiles.empty())
+			continue;
+		numTiles+=viewTiles.size();
+		spanned+=viewTiles.back()-viewTiles.front()+1;
+		for(size_t a=0;a<viewTiles.size();){
+			int f=(int)(upper_bound(fileFirst.begin(),fileFirst.end(),viewTiles[a])-fileFirst.begin())-1;
+			size_t b=a+1;
+			while(b<viewTiles.size() && viewTiles[b]==viewTiles[b-1]+1 && viewTiles[b]<fileFirst[f+1])
+				++b;
+			buf.resize((b-a)*SMALL_TILE_SIZE);
+			streams[f]->seekg(sizeof(TileFileHeader)+(size_t)(viewTiles[a]-fileFirst[f])*SMALL_TILE_SIZE);
+			streams[f]->read(&buf[0],buf.size());
+			numRuns++;
+			a=b;
+		}
+	}
+	for(size_t f=0;f<streams.size();++f)
+		delete streams[f];
+	double seconds=(boost::posix_time::microsec_clock::universal_time()-start).total_microseconds()/1e6;
+	numViews=max(numViews,1);
+	printf("Tile reads for %i views of %s: %.1f tiles in %.1f runs spanning %.1f tiles per view, %.3f ms per view\n",
+		numViews,file.c_str(),(double)numTiles/numViews,(double)numRuns/numViews,(double)spanned/numViews,seconds*1000/numViews);
+}
+
+void CTileHandler::BenchmarkKernels(int numTiles)
+{
+	//times CalcFastStat and CompareTiles, the plain versions against the sse2 ones, on the first
+	//tiles of the saved tile file and checks that both give the same results
+	string file=tileLibrary.empty() ? myTileFile : tileLibrary;
+	if(UseShards())
+		file=ShardFileName(0);
+	ifstream ifs(file.c_str(),ios::in | ios::binary);
+	TileFileHeader tfh;
+	ifs.read((char*)&tfh,sizeof(TileFileHeader));
+	if(!ifs || strcmp(tfh.magic,"spring tilefile")!=0){
+		printf("Couldnt read tile file %s\n",file.c_str());
+		return;
+	}
+	numTiles=min(numTiles,tfh.numTiles);
+	if(numTiles<2){
+		printf("Too few tiles in %s to time the kernels\n",file.c_str());
+		return;
+	}
+	vector<CBitmap> tiles(numTiles);
+	vector<unsigned char> matchData((size_t)numTiles*matchDataSize);
+	char ctile[SMALL_TILE_SIZE];
+	for(int t=0;t<numTiles;++t){
+		ifs.read(ctile,SMALL_TILE_SIZE);
+		tiles[t].CreateFromDXT1((unsigned char*)ctile,32,32);
+		ExtractMatchData(tiles[t].mem,&matchData[(size_t)t*matchDataSize]);
+	}
+	Thresholds th=ScaledThresholds(128);
+	int rounds=max(1,KERNEL_BENCH_CALLS/numTiles);
+	double calls=(double)rounds*numTiles;
+
+	//each tile is compared with the next one in the file, mostly tiles that failed to match
+	//and so stop early, like most compares of a search do
+	vector<FastStat> refStats(numTiles);
+	vector<char> refMatches(numTiles);
+	boost::posix_time::ptime start=boost::posix_time::microsec_clock::universal_time();
+	for(int r=0;r<rounds;++r){
+		for(int t=0;t<numTiles;++t)
+			refStats[t]=CalcFastStatRef(&tiles[t]);
+	}
+	double statRef=(boost::posix_time::microsec_clock::universal_time()-start).total_microseconds()*1000/calls;
+	start=boost::posix_time::microsec_clock::universal_time();
+	for(int r=0;r<rounds;++r){
+		for(int t=0;t<numTiles;++t)
+			refMatches[t]=CompareTilesRef(&matchData[(size_t)t*matchDataSize],&matchData[(size_t)((t+1)%numTiles)*matchDataSize],th);
+	}
+	double compareRef=(boost::posix_time::microsec_clock::universal_time()-start).total_microseconds()*1000/calls;
+	printf("Kernels on %i tiles of %s, plain: CalcFastStat %.0f ns, CompareTiles %.0f ns\n",numTiles,file.c_str(),statRef,compareRef);
+
+#ifdef TILEHANDLER_SSE2
+	vector<FastStat> sseStats(numTiles);
+	vector<char> sseMatches(numTiles);
+	start=boost::posix_time::microsec_clock::universal_time();
+	for(int r=0;r<rounds;++r){
+		for(int t=0;t<numTiles;++t)
+			sseStats[t]=CalcFastStatSSE2(&tiles[t]);
+	}
+	double statSSE2=(boost::posix_time::microsec_clock::universal_time()-start).total_microseconds()*1000/calls;
+	start=boost::posix_time::microsec_clock::universal_time();
+	for(int r=0;r<rounds;++r){
+		for(int t=0;t<numTiles;++t)
+			sseMatches[t]=CompareTilesSSE2(&matchData[(size_t)t*matchDataSize],&matchData[(size_t)((t+1)%numTiles)*matchDataSize],th);
+	}
+	double compareSSE2=(boost::posix_time::microsec_clock::universal_time()-start).total_microseconds()*1000/calls;
+	int differences=0;
+	for(int t=0;t<numTiles;++t){
+		if(memcmp(&refStats[t],&sseStats[t],sizeof(FastStat))!=0 || refMatches[t]!=sseMatches[t])
+			differences++;
+	}
+	printf("Kernels on %i tiles of %s, sse2: CalcFastStat %.0f ns, CompareTiles %.0f ns, %i tiles with different results\n",
+		numTiles,file.c_str(),statSSE2,compareSSE2,differences);
+#else
+	printf("Built without sse2, only the plain kernels were timed\n");
+#endif
+	for(int t=0;t<numTiles;++t)
+		delete[] tiles[t].mem;
+}
+
+bool CTileHandler::UseShards(void)
+{
+	return numShards>1 && tileLibrary.empty();
+}
+
+string CTileHandler::ShardFileName(int shard)
+{
+	char num[16];
+	sprintf(num,"_%i",shard);
+	return myTileFile.substr(0,myTileFile.find_last_of('.'))+num+".smt";
+}
+
+void CTileHandler::StartShards(void)
+{
+	//new tile i goes to shard i%numShards, so every shard can be written while the map is matched
+	TileFileHeader tfh;
+	strcpy(tfh.magic,"spring tilefile");
+	tfh.version=1;
+	tfh.tileSize=32;
+	tfh.compressionType=1;
+	tfh.numTiles=0;		//written again once the count is known
+	for(int k=0;k<numShards;++k){
+		ofstream* sf=new ofstream(ShardFileName(k).c_str(),ios::binary | ios::out);
+		sf->write((char*)&tfh,sizeof(TileFileHeader));
+		shardFiles.push_back(sf);
+	}
+	streamedTiles=0;
+}
+
+void CTileHandler::WriteShards(void)
+{
+	//hands the tiles created since the last call to the shard threads, the copy lets newTiles
+	//grow while they write
+	JoinShardWriters();
+	int internalTiles=usedTiles-numExternalTile;
+	if(internalTiles==streamedTiles)
+		return;
+	pendingTiles.assign(newTiles.begin()+(size_t)streamedTiles*SMALL_TILE_SIZE,newTiles.begin()+(size_t)internalTiles*SMALL_TILE_SIZE);
+	pendingFirst=streamedTiles;
+	streamedTiles=internalTiles;
+	shardWriters=new boost::thread_group;
+	for(int k=0;k<numShards;++k)
+		shardWriters->create_thread(boost::bind(&CTileHandler::WriteShardTiles,this,k));
+}
+
+void CTileHandler::JoinShardWriters(void)
+{
+	if(!shardWriters)
+		return;
+	shardWriters->join_all();
+	delete shardWriters;
+	shardWriters=0;
+}
+
+void CTileHandler::WriteShardTiles(int shard)
+{
+	int numPending=(int)(pendingTiles.size()/SMALL_TILE_SIZE);
+	for(int a=0;a<numPending;++a){
+		if((pendingFirst+a)%numShards==shard)
+			shardFiles[shard]->write(&pendingTiles[(size_t)a*SMALL_TILE_SIZE],SMALL_TILE_SIZE);
+	}
+}
+
+void CTileHandler::FinishShards(void)
+{
+	//writes what was not streamed yet, all of it if the tiles were reordered or are from
+	//another level so nothing was streamed, then gives every shard its tile count and renumbers tileUse to match
+	if(shardFiles.empty())
+		StartShards();
+	WriteShards();
+	JoinShardWriters();
+	vector<char>().swap(pendingTiles);
+
+	int internalTiles=usedTiles-numExternalTile;
+	shardOffsets.assign(numShards+1,0);
+	for(int k=0;k<numShards;++k)
+		shardOffsets[k+1]=shardOffsets[k]+(internalTiles-k+numShards-1)/numShards;
+	for(int k=0;k<numShards;++k){
+		TileFileHeader tfh;
+		strcpy(tfh.magic,"spring tilefile");
+		tfh.version=1;
+		tfh.tileSize=32;
+		tfh.compressionType=1;
+		tfh.numTiles=shardOffsets[k+1]-shardOffsets[k];
+		shardFiles[k]->seekp(0);
+		shardFiles[k]->write((char*)&tfh,sizeof(TileFileHeader));
+		delete shardFiles[k];
+	}
+	shardFiles.clear();
+
+	for(vector<int>::iterator ui=tileUse.begin();ui!=tileUse.end();++ui){
+		if(*ui>=numExternalTile){
+			int t=*ui-numExternalTile;
+			*ui=numExternalTile+shardOffsets[t%numShards]+t/numShards;
+		}
+	}
+}
+
+bool CTileHandler::LoadTileLibrary(void)
+{
+	//the library and its index are mapped like the external files, but the library tiles are
+	//added as normal tiles from the index records so the files are closed again before they grow
+	CMappedFile mf(tileLibrary);
+	if(!mf.IsOpen()){
+		printf("Creating tile library %s\n",tileLibrary.c_str());
+		return true;
+	}
+	TileFileHeader tfh;
+	if(mf.Size()<sizeof(TileFileHeader)){
+		printf("Error opening tile library %s\n",tileLibrary.c_str());
+		return false;
+	}
+	memcpy(&tfh,mf.Data(),sizeof(TileFileHeader));
+	if(strcmp(tfh.magic,"spring tilefile")!=0 || tfh.version!=1 || tfh.tileSize!=32 || tfh.numTiles<0
+	|| mf.Size()<sizeof(TileFileHeader)+(size_t)tfh.numTiles*SMALL_TILE_SIZE){
+		printf("Error opening tile library %s\n",tileLibrary.c_str());
+		return false;
+	}
+
+	//an index made for other settings or missing tiles is made again from the .smt
+	if(!LoadTileIndex(tfh.numTiles)){
+		printf("Indexing %i tiles of tile library %s\n",tfh.numTiles,tileLibrary.c_str());
+		AppendTileIndex(mf.Data()+sizeof(TileFileHeader),tfh.numTiles,0);
+		if(!LoadTileIndex(tfh.numTiles)){
+			printf("Error writing tile index %s\n",TileIndexName().c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+bool CTileHandler::LoadTileIndex(int numTiles)
+{
+	CMappedFile index(TileIndexName());
+	if(!index.IsOpen() || index.Size()<sizeof(TileIndexHeader))
+		return false;
+	TileIndexHeader tih;
+	memcpy(&tih,index.Data(),sizeof(TileIndexHeader));
+	if(strcmp(tih.magic,"mapconv tileidx")!=0 || tih.version!=1 || tih.numTiles!=numTiles
+	|| tih.tileMetric!=tileMetric || tih.tileMatcher!=tileMatcher || tih.matchDataSize!=matchDataSize
+	|| tih.recordSize!=TILE_INDEX_RECORD_HEADER+matchDataSize
+	|| index.Size()<sizeof(TileIndexHeader)+(size_t)numTiles*tih.recordSize)
+		return false;
+
+	printf("Loading %i tiles from tile library %s\n",numTiles,tileLibrary.c_str());
+	fastStats.reserve(usedTiles+numTiles);
+	tileMatchData.reserve((size_t)(usedTiles-numLazyTiles+numTiles)*matchDataSize);
+	libraryHashes.resize(numTiles);
+	const char* record=index.Data()+sizeof(TileIndexHeader);
+	for(int a=0;a<numTiles;++a,record+=tih.recordSize){
+		FastStat fs;
+		memcpy(&libraryHashes[a],record,8);
+		memcpy(&fs,record+8,sizeof(FastStat));
+		AddTile(fs,(const unsigned char*)record+TILE_INDEX_RECORD_HEADER);
+	}
+	numLibraryTiles=numTiles;
+	return true;
+}
+
+void CTileHandler::AppendTileIndex(const char* tiles,int numTiles,int oldTiles)
+{
+	//writes the records of numTiles tiles after the first oldTiles, a new index if oldTiles is 0
+	TileIndexHeader tih;
+	memset(&tih,0,sizeof(TileIndexHeader));
+	strcpy(tih.magic,"mapconv tileidx");
+	tih.version=1;
+	tih.numTiles=oldTiles+numTiles;
+	tih.tileMetric=tileMetric;
+	tih.tileMatcher=tileMatcher;
+	tih.matchDataSize=matchDataSize;
+	tih.recordSize=TILE_INDEX_RECORD_HEADER+matchDataSize;
+
+	fstream ifs(TileIndexName().c_str(),ios::binary | ios::in | ios::out | (oldTiles==0 ? ios::trunc : (ios::openmode)0));
+	if(!ifs.is_open()){
+		printf("Couldnt write tile index %s\n",TileIndexName().c_str());
+		return;
+	}
+	ifs.write((char*)&tih,sizeof(TileIndexHeader));
+	ifs.seekp(sizeof(TileIndexHeader)+(size_t)oldTiles*tih.recordSize);
+
+	vector<char> record(tih.recordSize,0);
+	for(int a=0;a<numTiles;++a){
+		const char* tile=&tiles[(size_t)a*SMALL_TILE_SIZE];
+		unsigned long long hash=HashTileData(tile);
+		FastStat fs;
+		CalcCompressedStat((const unsigned char*)tile,8,fs,(unsigned char*)&record[TILE_INDEX_RECORD_HEADER]);
+		memcpy(&record[0],&hash,8);
+		memcpy(&record[8],&fs,sizeof(FastStat));
+		ifs.write(&record[0],tih.recordSize);
+	}
+}
+
+void CTileHandler::AppendToTileLibrary(void)
+{
+	int internalTiles=usedTiles-numExternalTile;
+	printf("Adding %i tiles to tile library %s\n",internalTiles,tileLibrary.c_str());
+
+	TileFileHeader tfh;
+	strcpy(tfh.magic,"spring tilefile");
+	tfh.version=1;
+	tfh.tileSize=32;
+	tfh.compressionType=1;
+	tfh.numTiles=numLibraryTiles+internalTiles;
+
+	//the new tiles go right after the ones loaded, then the header gets the new total
+	fstream tf(tileLibrary.c_str(),ios::binary | ios::in | ios::out | (numLibraryTiles==0 ? ios::trunc : (ios::openmode)0));
+	if(!tf.is_open()){
+		printf("Couldnt write tile library %s\n",tileLibrary.c_str());
+		return;
+	}
+	tf.write((char*)&tfh,sizeof(TileFileHeader));
+	tf.seekp(sizeof(TileFileHeader)+(size_t)numLibraryTiles*SMALL_TILE_SIZE);
+	if(internalTiles>0)
+		tf.write(&newTiles[0],(size_t)internalTiles*SMALL_TILE_SIZE);
+	tf.close();
+
+	if(internalTiles>0)
+		AppendTileIndex(&newTiles[0],internalTiles,numLibraryTiles);
+	else if(numLibraryTiles==0)
+		AppendTileIndex(0,0,0);
+}
+
+void CTileHandler::AddLibraryDuplicates(void)
+{
+	//a map tile with the same compressed data as a library tile always uses that tile
+	int firstTile=numExternalTile-numLibraryTiles;
+	for(int a=0;a<numLibraryTiles;++a){
+		DuplicateTile dt;
+		dt.tile=firstTile+a;
+		dt.skipped=-1;
+		dt.level=-1;
+		duplicateTiles.insert(make_pair(libraryHashes[a],dt));
+	}
+}
+
+string CTileHandler::TileIndexName(void)
+{
+	return tileLibrary.substr(0,tileLibrary.find_last_of('.'))+".sti";
+}
+
+void CTileHandler::ReadTile(int xpos, int ypos, char *destbuf, char *sourcebuf)
+{
+	int doffset = 0;
+	int soffset = 0;
+
+	for(int i=0; i<4; i++)
+	{
+		int div = 1<<i;
+		int xp = 8/div;
+		int yp = 8/div;
+		for(int y=0; y<yp; y++)
+		{
+			for(int x=0; x<xp; x++)
+			{
+				char *destptr = &destbuf[(x+y*xp)*8 + doffset];
+				char *srcptr = &sourcebuf[((x+xpos/div/4)+((y+ypos/div/4))*(256/(div)))*8 + soffset];
+
+				for(int i=0; i<8; i++)
+					destptr[i] = srcptr[i];
+			}
+		}
+		doffset += 512/(1<<(i*2));
+		soffset += 524288/(1<<(i*2));
+	}
+}
+
+void CTileHandler::WriteTile(int xpos, int ypos, const char *sourcebuf, char *destbuf)
+{
+	//the reverse of ReadTile
+	int soffset = 0;
+	int doffset = 0;
+
+	for(int i=0; i<4; i++)
+	{
+		int div = 1<<i;
+		int xp = 8/div;
+		int yp = 8/div;
+		for(int y=0; y<yp; y++)
+			memcpy(&destbuf[((xpos/div/4)+((y+ypos/div/4))*(256/(div)))*8 + doffset], &sourcebuf[(y*xp)*8 + soffset], xp*8);
+		soffset += 512/(1<<(i*2));
+		doffset += 524288/(1<<(i*2));
+	}
+}
+
+unsigned long long CTileHandler::HashTile(int xpos, int ypos, char *sourcebuf)
+{
+	//walks the blocks in the same order as ReadTile, 64 bit so collisions can be ignored
+	unsigned long long hash=14695981039346656037ULL;
+	int soffset = 0;
+
+	for(int i=0; i<4; i++)
+	{
+		int div = 1<<i;
+		int xp = 8/div;
+		int yp = 8/div;
+		for(int y=0; y<yp; y++)
+		{
+			for(int x=0; x<xp; x++)
+			{
+				unsigned long long block;
+				memcpy(&block, &sourcebuf[((x+xpos/div/4)+((y+ypos/div/4))*(256/(div)))*8 + soffset], 8);
+				hash^=block;
+				hash*=1099511628211ULL;
+				hash^=hash>>32;
+			}
+		}
+		soffset += 524288/(1<<(i*2));
+	}
+	return hash;
+}
+
+unsigned long long CTileHandler::HashTileData(const char* tile)
+{
+	//same hash as HashTile for a tile already cut out by ReadTile
+	unsigned long long hash=14695981039346656037ULL;
+	for(int a=0;a<SMALL_TILE_SIZE/8;++a){
+		unsigned long long block;
+		memcpy(&block,&tile[a*8],8);
+		hash^=block;
+		hash*=1099511628211ULL;
+		hash^=hash>>32;
+	}
+	return hash;
+}
+
+void CTileHandler::PrepareSquareTiles(int thread)
+{
+	//with the neighbour cache each thread takes runs of TILE_CACHE_RUN tiles along the curve and
+	//first tries the tiles matched earlier in the run, the runs do not depend on the thread count
+	bool useHash=meanThreshold>0 && meanDirThreshold>0 && matchThreshold>=0;
+	int run=neighbourCache ? TILE_CACHE_RUN : 1;
+	vector<int>& candidates=searchCandidates[thread];
+	for(int first=thread*run;first<1024;first+=numThreads*run){
+		int recent[TILE_CACHE_SIZE];
+		int numRecent=0;
+		for(int i=first;i<first+run;++i){
+			int b=squareOrder[i];
+			SquareTile& st=squareTiles[b];
+			st.decoded=false;
+			st.match=-2;
+			st.cacheLookup=false;
+			st.cached=false;
+			st.level=MaskLevel(curSquare,b);
+			st.stats.candidates=0;
+			st.stats.rejected=0;
+			st.stats.compares=0;
+
+			//exact duplicates of earlier tiles are usually settled without decoding
+			if(useHash){
+				if(!rgbaTileIndex.empty())
+					st.hash=rgbaTileHashes[rgbaTileIndex[curSquare*1024+b]];
+				else
+					st.hash=cachedHashes.empty() ? HashTile((b%32)*32,(b/32)*32,curBigTile) : cachedHashes[curSquare*1024+b];
+				map<unsigned long long,DuplicateTile>::const_iterator di=duplicateTiles.find(st.hash);
+				if(di!=duplicateTiles.end() && (di->second.level==-1 || di->second.level==st.level))
+					continue;
+			}
+
+			Thresholds th=ScaledThresholds(st.level);
+			SearchStats* stats=recordStats ? &st.stats : 0;
+			DecodeSquareTile(b);
+			if(neighbourCache){
+				st.match=ProbeTileCache(st.fs,st.matchData,recent,numRecent,-1,0,squareStartTile,th,stats);
+				st.cacheLookup=true;
+				st.cached=st.match!=-1;
+			}
+			if(!st.cached)
+				st.match=FindCloseTile(st.fs,st.matchData,-1,0,squareStartTile,th,stats,candidates);
+			if(neighbourCache && st.match>=0)
+				RememberTile(recent,numRecent,st.match);
+		}
+	}
 }
 
-void CTileHandler::LoadTexture(string name)
+void CTileHandler::DecodeSquareTile(int b)
 {
-	printf("Loading texture\n");
-	bigTex.Load(name);
+	SquareTile& st=squareTiles[b];
+	if(!cachedStats.empty()){
+		int n=curSquare*1024+b;
+		st.fs=cachedStats[n];
+		memcpy(st.matchData,&cachedMatchData[(size_t)n*matchDataSize],matchDataSize);
+		st.decoded=true;
+		return;
+	}
+	if(!rgbaTileIndex.empty()){
+		int u=rgbaTileIndex[curSquare*1024+b];
+		st.fs=rgbaStats[u];
+		memcpy(st.matchData,&rgbaMatchData[(size_t)u*matchDataSize],matchDataSize);
+		st.decoded=true;
+		return;
+	}
+	CalcCompressedStat((unsigned char*)&curBigTile[((b%32)*8+(b/32)*8*256)*8],256,st.fs,st.matchData);
+	st.decoded=true;
 
-	xsize=bigTex.xsize/8;
-	ysize=bigTex.ysize/8;
+#ifdef _DEBUG
+	char ctile[SMALL_TILE_SIZE];
+	unsigned char matchData[TILE_MATCH_SIZE];
+	ReadTile((b%32)*32,(b/32)*32,ctile,curBigTile);
+	CBitmap bm;
+	bm.CreateFromDXT1((unsigned char*)ctile,32,32);
+	FastStat fs=CalcFastStat(&bm);
+	ExtractMatchData(bm.mem,matchData);
+	assert(memcmp(&fs,&st.fs,sizeof(FastStat))==0 && memcmp(matchData,st.matchData,matchDataSize)==0);
+	delete[] bm.mem;
+#endif
 }
 
-void CTileHandler::ProcessTiles(float compressFactor,bool fastcompress)
+int CTileHandler::FindCloseTile(const FastStat& fs,const unsigned char* data,int forbidden,int startTile,int endTile,const Thresholds& th,SearchStats* stats,vector<int>& candidates)
 {
-	meanThreshold=(int)(2000*compressFactor);
-	meanDirThreshold=(int)(20000*compressFactor);
-	borderThreshold=(int)(80000*compressFactor);
-
-	system("mkdir temp");
+	//returns the first tile in [startTile,endTile) other than forbidden that is close enough, -1 if none
+	//candidates is scratch space kept by the caller so a search doesnt allocate
+	if(meanThreshold<=0 || th.mean<=0)
+		return -1;
 
-	usedTiles=0;
-	unsigned char buf[SMALL_TILE_SIZE];
-
-	for(vector<string>::iterator fi=externalFiles.begin();fi!=externalFiles.end();++fi){
-		ifstream ifs(fi->c_str(),ios::in | ios::binary);
-		if(!ifs.is_open()){
-			printf("Couldnt find tile file %s\n",fi->c_str());
-			continue;
+	unsigned char buf[TILE_MATCH_SIZE];
+	candidates.clear();
+	if(tileMatcher==MATCHER_LSH){
+		unsigned long long keys[LSH_TABLES];
+		LshKeys(fs,data,keys);
+		for(int t=0;t<LSH_TABLES;++t){
+			map<unsigned long long,vector<int> >::const_iterator ci=lshTables[t].find(keys[t]);
+			if(ci==lshTables[t].end())
+				continue;
+			for(vector<int>::const_iterator ti=ci->second.begin();ti!=ci->second.end();++ti){
+				if(*ti>=startTile && *ti<endTile && *ti!=forbidden)
+					candidates.push_back(*ti);
+			}
 		}
-		TileFileHeader tfh;
-		ifs.read((char*)&tfh,sizeof(TileFileHeader));
-
-		if(strcmp(tfh.magic,"spring tilefile")!=0 || tfh.version!=1 || tfh.tileSize!=32){
-			printf("Error opening tile file %s\n",fi->c_str());
-			continue;
+		//a tile is in several tables, test each once and in tile order
+		sort(candidates.begin(),candidates.end());
+		candidates.erase(unique(candidates.begin(),candidates.end()),candidates.end());
+		int found=-1;
+		int rejected=0;
+		int compares=0;
+		for(vector<int>::iterator ti=candidates.begin();ti!=candidates.end();++ti){
+			if(!CompareFastStat(fs,fastStats[*ti],th)){
+				rejected++;
+				continue;
+			}
+			compares++;
+			if(CompareTiles(data,TileMatchData(*ti,buf),th)){
+				found=*ti;
+				break;
+			}
+		}
+		if(stats){
+			stats->candidates+=(int)candidates.size();
+			stats->rejected+=rejected;
+			stats->compares+=compares;
 		}
-		externalFileTileSize.push_back(tfh.numTiles);
-
-		printf("Loading %i tiles from %s\n",tfh.numTiles,fi->c_str());
-		for(int a=0;a<tfh.numTiles;++a){
-			ifs.read((char*)buf,SMALL_TILE_SIZE);
-			CBitmap* bm=new CBitmap();
-			bm->CreateFromDXT1(buf,32,32);
 
-			fastStats[usedTiles]=CalcFastStat(bm);
-			tiles[usedTiles++]=bm;
+		if(checkLshRecall){
+			bool exists=found!=-1;
+			for(int t=startTile;t<endTile && !exists;++t){
+				if(t!=forbidden && CompareFastStat(fs,fastStats[t],th) && CompareTiles(data,TileMatchData(t,buf),th))
+					exists=true;
+			}
+			if(exists){
+				boost::mutex::scoped_lock lock(lshRecallMutex);
+				lshSearches++;
+				if(found!=-1)
+					lshFound++;
+			}
 		}
+		return found;
 	}
 
-	numExternalTile=usedTiles;
+	//larger thresholds from the mask reach more cells
+	int cr=fs.r/meanThreshold;
+	int cg=fs.g/meanThreshold;
+	int cb=fs.b/meanThreshold;
+	int reach=(th.mean+meanThreshold-1)/meanThreshold;
+	int examined=0;
 
-	unsigned char* data=new unsigned char[1024*1024*4];
-	int tilex=xsize/4;
-	int tiley=ysize/4;
-	int bigsquaretexx=tilex/32;
-	int bigsquaretexy=tiley/32;
-	int a=0;
-	for(int j=0;j<bigsquaretexy;j++){
-		for(int i=0;i<bigsquaretexx;i++){
-			int ox=1024*i;
-			int oy=1024*j;
-			
-
-			for(int y2=0;y2<1024;++y2){
-				for(int x2=0;x2<1024;++x2){
-					data[(y2*1024 +x2)*4 +0]=bigTex.mem[(ox +(oy+y2)*xsize*8 +x2)*4 +0];
-					data[(y2*1024 +x2)*4 +1]=bigTex.mem[(ox +(oy+y2)*xsize*8 +x2)*4 +1];
-					data[(y2*1024 +x2)*4 +2]=bigTex.mem[(ox +(oy+y2)*xsize*8 +x2)*4 +2];
-					data[(y2*1024 +x2)*4 +3]=bigTex.mem[(ox +(oy+y2)*xsize*8 +x2)*4 +3];
+	for(int r=cr-reach;r<=cr+reach;++r){
+		for(int g=cg-reach;g<=cg+reach;++g){
+			for(int b=cb-reach;b<=cb+reach;++b){
+				if(r<0 || g<0 || b<0)
+					continue;
+				map<long long,vector<int> >::const_iterator ci=statIndex.find(StatCell(r,g,b));
+				if(ci==statIndex.end())
+					continue;
+				for(vector<int>::const_iterator ti=ci->second.begin();ti!=ci->second.end();++ti){
+					if(*ti<startTile || *ti>=endTile || *ti==forbidden)
+						continue;
+					examined++;
+					if(CompareFastStat(fs,fastStats[*ti],th))
+						candidates.push_back(*ti);
 				}
 			}
-
-			CBitmap square(data,1024,1024);
-			char name[100];
-			sprintf(name,"temp/Temp%03i.tga",a);
-			square.Save(name);
-			printf("Writing tga files %i%%\n", (((a+1)*1024)*100)/(tilex*tiley));
-			a++;
 		}
 	}
-	int numbigsquares=(xsize/128)*(ysize/128);
-	printf("Creating dds files\n");
-	char execstring[512];
-	if (fastcompress){
-		for (int i=0;i<numbigsquares;i++){
-			sprintf(execstring, "nvcompress.exe -fast -bc1a temp/Temp%03i.tga Temp%03i.dds",i,i);
-			printf("%s\n", execstring);
-			system(execstring);
+	//test in tile order so we pick the same tile as a linear scan would
+	sort(candidates.begin(),candidates.end());
+	int found=-1;
+	int compares=0;
+	for(vector<int>::iterator ti=candidates.begin();ti!=candidates.end();++ti){
+		compares++;
+		if(CompareTiles(data,TileMatchData(*ti,buf),th)){
+			found=*ti;
+			break;
 		}
-	
-	}else{
-		sprintf(execstring, "%s temp/Temp*.tga",stupidGlobalCompressorName.c_str());
-		printf("%s\n", execstring);
-		system(execstring);
 	}
-#ifdef WIN32
-	system("del /Q temp\\Temp*.tga");
-	system("del /Q temp");
-#else	
-	system("rm temp/Temp*.tga");
-#endif
-
-	delete[] data;
+	if(stats){
+		stats->candidates+=examined;
+		stats->rejected+=examined-(int)candidates.size();
+		stats->compares+=compares;
+	}
+	return found;
 }
 
-void CTileHandler::ProcessTiles2(void)
+int CTileHandler::AddTile(const FastStat& fs,const unsigned char* data)
 {
-	unsigned char* data=new unsigned char[1024*1024*4];
-	bigTex=CBitmap(data,1,1);	//free big tex memory
-	int tilex=xsize/4;
-	int tiley=ysize/4;
-	int bigx=tilex/32;
-	int bigy=tiley/32;
-	int a=0;
-
-	for(int a=0;a<bigx*bigy;++a){
-		int startTilex=(a%bigx)*32;
-		int startTiley=(a/bigx)*32;
+	fastStats.push_back(fs);
+	tileMatchData.insert(tileMatchData.end(),data,data+matchDataSize);
+	IndexTile(usedTiles);
+	return usedTiles++;
+}
 
-#ifdef WIN32
-		DDSURFACEDESC2 ddsheader;
-		int ddssignature;
-		char name[100];
-		sprintf(name,"Temp%03i.dds",a);
-		CFileHandler file(name);
-		file.Read(&ddssignature, sizeof(int));
-		file.Read(&ddsheader, sizeof(DDSURFACEDESC2));
-#else
-		char name[100];
-		snprintf(name, 100, "temp/Temp%03i.bmp.raw", a);
-		CFileHandler file(name);
-#endif
+void CTileHandler::ExtractMatchData(const unsigned char* rgba,unsigned char* data)
+{
+	if(tileMatcher==MATCHER_LSH)
+		ExtractSketch(rgba,data+matchDataSize-TILE_SKETCH_SIZE);
 
-		char bigtile[696320]; //1024x1024 and 4 mipmaps
-		file.Read(bigtile, 696320);
+	if(tileMetric==METRIC_BORDER){
+		//same pixel order as the old row by row walk, top row, both sides, bottom row
+		int n=0;
+		for(int y=0;y<32;++y){
+			for(int x=0;x<32;++x){
+				if(!(y==0 || y==31 || x==0 || x==31))
+					continue;
+				data[n++]=rgba[(y*32+x)*4+0];
+				data[n++]=rgba[(y*32+x)*4+1];
+				data[n++]=rgba[(y*32+x)*4+2];
+			}
+		}
+		memset(data+n,0,TILE_BORDER_SIZE-n);
+		return;
+	}
 
-		for(int b=0;b<1024;++b){
-			int x=b%32;
-			int y=b/32;
-			int xb=startTilex+x; //curr pointer to tile in bigtex
-			int yb=startTiley+y;
+	for(int a=0;a<32*32;++a){
+		int r=rgba[a*4+0];
+		int g=rgba[a*4+1];
+		int b=rgba[a*4+2];
+		if(tileMetric==METRIC_YCOCG){
+			data[a*4+0]=(r+2*g+b)/4;
+			data[a*4+1]=(r-b+256)/2;
+			data[a*4+2]=(2*g-r-b+512)/4;
+		} else {
+			data[a*4+0]=r;
+			data[a*4+1]=g;
+			data[a*4+2]=b;
+		}
+		data[a*4+3]=0;
+	}
 
-			char* ctile=new char[SMALL_TILE_SIZE];
-			ReadTile(x*32,y*32,ctile,bigtile);
-			CBitmap* bm=new CBitmap();
-			bm->CreateFromDXT1((unsigned char*)ctile,32,32);
+	if(tileMetric==METRIC_MAXBLOCK)
+		return;
 
-			int t1=tileUse[max(0,(yb-1)*tilex+xb)];
-			int t2=tileUse[max(0,yb*tilex+xb-1)];
-			int ct=FindCloseTile(bm,t1==t2?t1:-1);
-			if(ct==-1){
-				tileUse[yb*tilex+xb]=usedTiles;
-				tiles[usedTiles++]=bm;
-				newTiles.push_back(ctile);
-			} else {
-				tileUse[yb*tilex+xb]=ct;
-				delete bm;
-				delete[] ctile;
+	//rgb sums of the 8x8 and 4x4 pixel cells for the coarse test in CompareTiles,
+	//the 4x4 cells first and then the 8x8 cells made of four of them
+	unsigned short* coarse=(unsigned short*)(data+TILE_PIXELS_SIZE);
+	unsigned short* cells=coarse+16*3;
+	for(int cy=0;cy<8;++cy){
+		for(int cx=0;cx<8;++cx){
+			int sum[3]={0,0,0};
+			for(int y=cy*4;y<cy*4+4;++y){
+				const unsigned char* p=&data[(y*32+cx*4)*4];
+				for(int c=0;c<3;++c)
+					sum[c]+=p[c]+p[4+c]+p[8+c]+p[12+c];
 			}
+			for(int c=0;c<3;++c)
+				cells[(cy*8+cx)*3+c]=sum[c];
 		}
-		printf("Creating tiles %i/%i %i%%\n", usedTiles-numExternalTile,(a+1)*1024,(((a+1)*1024)*100)/(tilex*tiley));
 	}
+	for(int cy=0;cy<4;++cy){
+		for(int cx=0;cx<4;++cx){
+			for(int c=0;c<3;++c){
+				coarse[(cy*4+cx)*3+c]=cells[(cy*16+cx*2)*3+c]+cells[(cy*16+cx*2+1)*3+c]
+					+cells[(cy*16+8+cx*2)*3+c]+cells[(cy*16+8+cx*2+1)*3+c];
+			}
+		}
+	}
+}
 
-	delete[] data;
-#ifdef WIN32
-	system("del /q temp*.dds");
-#else
-	system("rm temp/Temp*.bmp.raw");
-#endif
+void CTileHandler::ExtractSketch(const unsigned char* rgba,unsigned char* data)
+{
+	//rgb sums of the four 16x16 pixel quadrants
+	int quads[12];
+	memset(quads,0,sizeof(quads));
+	for(int y=0;y<32;++y){
+		for(int x=0;x<32;++x){
+			int* quad=&quads[((y/16)*2+x/16)*3];
+			for(int c=0;c<3;++c)
+				quad[c]+=rgba[(y*32+x)*4+c];
+		}
+	}
+	memcpy(data,quads,TILE_SKETCH_SIZE);
 }
 
-void CTileHandler::SaveData(ofstream& ofs)
+bool CTileHandler::CompareFastStat(const FastStat& fs, const FastStat& fs2, const Thresholds& th)
 {
-	//write tile header
-	MapTileHeader mth;
-	mth.numTileFiles=(int)externalFiles.size()+1;
-	mth.numTiles=usedTiles;
-	ofs.write((char*)&mth,sizeof(MapTileHeader));
+	return abs(fs.r-fs2.r)<th.mean && abs(fs.g-fs2.g)<th.mean && abs(fs.b-fs2.b)<th.mean
+		&& abs(fs.rx-fs2.rx)<th.meanDir && abs(fs.gx-fs2.gx)<th.meanDir && abs(fs.bx-fs2.bx)<th.meanDir
+		&& abs(fs.ry-fs2.ry)<th.meanDir && abs(fs.gy-fs2.gy)<th.meanDir && abs(fs.by-fs2.by)<th.meanDir;
+}
 
-	//write external tile files used
-	for(int fileNum=0;fileNum<(int)externalFiles.size();++fileNum){
-		ofs.write((char*)&externalFileTileSize[fileNum],4);
-		ofs.write(externalFiles[fileNum].c_str(),externalFiles[fileNum].size()+1);
-	}
-	//write new tile file to be created
-	int internalTiles=usedTiles-numExternalTile;
-	ofs.write((char*)&internalTiles,4);
-	ofs.write(myTileFile.c_str(),myTileFile.size()+1);
+long long CTileHandler::StatCell(int r,int g,int b)
+{
+	//a channel sum is at most 255*32*32 so each cell coordinate fits in 20 bits
+	return ((long long)r<<40) | ((long long)g<<20) | (long long)b;
+}
 
-	//write tiles
-	for(int y=0; y<ysize/4; y++){
-		for(int x=0; x<xsize/4; x++){
-			int num = tileUse[x+y*xsize/4];
-			ofs.write((char*)&num, sizeof(int));
-		}
+void CTileHandler::IndexTile(int tile)
+{
+	if(meanThreshold<=0)
+		return;
+	FastStat& fs=fastStats[tile];
+	if(tileMatcher==MATCHER_LSH){
+		unsigned long long keys[LSH_TABLES];
+		unsigned char buf[TILE_MATCH_SIZE];
+		LshKeys(fs,TileMatchData(tile,buf),keys);
+		for(int t=0;t<LSH_TABLES;++t)
+			lshTables[t][keys[t]].push_back(tile);
+		return;
 	}
+	statIndex[StatCell(fs.r/meanThreshold,fs.g/meanThreshold,fs.b/meanThreshold)].push_back(tile);
+}
 
-	//create new tile file
+//fills the four colour palette of a DXT1 block and returns its index bits
+static unsigned int DecodeBlockPalette(const unsigned char* block,unsigned char pal[4][3])
+{
+	unsigned short color0,color1;
+	unsigned int indices;
+	memcpy(&color0,&block[0],2);
+	memcpy(&color1,&block[2],2);
+	memcpy(&indices,&block[4],4);
 
-	ofstream tf(myTileFile.c_str(),ios::binary | ios::out);
+	int r0=((color0&0xF800)>>11)<<3;
+	int g0=((color0&0x07E0)>>5)<<2;
+	int b0=(color0&0x001F)<<3;
+	int r1=((color1&0xF800)>>11)<<3;
+	int g1=((color1&0x07E0)>>5)<<2;
+	int b1=(color1&0x001F)<<3;
 
-	TileFileHeader tfh;
-	strcpy(tfh.magic,"spring tilefile");
-	tfh.version=1;
-	tfh.tileSize=32;
-	tfh.compressionType=1;
-	tfh.numTiles=internalTiles;
+	pal[0][0]=r0; pal[0][1]=g0; pal[0][2]=b0;
+	pal[1][0]=r1; pal[1][1]=g1; pal[1][2]=b1;
+	if(color0>color1){
+		pal[2][0]=(r0*2+r1)/3; pal[2][1]=(g0*2+g1)/3; pal[2][2]=(b0*2+b1)/3;
+		pal[3][0]=(r0+r1*2)/3; pal[3][1]=(g0+g1*2)/3; pal[3][2]=(b0+b1*2)/3;
+	} else {
+		pal[2][0]=(r0+r1)/2; pal[2][1]=(g0+g1)/2; pal[2][2]=(b0+b1)/2;
+		pal[3][0]=0; pal[3][1]=0; pal[3][2]=0;
+	}
+	return indices;
+}
 
-	tf.write((char*)&tfh,sizeof(TileFileHeader));
+void CTileHandler::InitLsh(void)
+{
+	//gaussian projections and uniform offsets from a fixed seed so runs are repeatable
+	lshProjections.resize(LSH_TABLES*LSH_PROJECTIONS*LSH_DIMS);
+	lshOffsets.resize(LSH_TABLES*LSH_PROJECTIONS);
+	unsigned int seed=12345;
+	for(size_t a=0;a<lshProjections.size();++a){
+		float u1=(NextRandom(seed)+1.0f)/16777217.0f;
+		float u2=NextRandom(seed)/16777216.0f;
+		lshProjections[a]=sqrtf(-2*logf(u1))*cosf(6.2831853f*u2);
+	}
+	for(size_t a=0;a<lshOffsets.size();++a)
+		lshOffsets[a]=NextRandom(seed)/16777216.0f*LSH_BUCKET_WIDTH;
+}
+
+void CTileHandler::LshKeys(const FastStat& fs,const unsigned char* data,unsigned long long* keys)
+{
+	//scale so that tiles passing CompareFastStat differ by less than one in each stat,
+	//the quadrant sums are scaled like the means of a whole tile
+	int quads[12];
+	memcpy(quads,data+matchDataSize-TILE_SKETCH_SIZE,TILE_SKETCH_SIZE);
+	float v[LSH_DIMS];
+	v[0]=(float)fs.r/meanThreshold;
+	v[1]=(float)fs.g/meanThreshold;
+	v[2]=(float)fs.b/meanThreshold;
+	v[3]=(float)fs.rx/meanDirThreshold;
+	v[4]=(float)fs.gx/meanDirThreshold;
+	v[5]=(float)fs.bx/meanDirThreshold;
+	v[6]=(float)fs.ry/meanDirThreshold;
+	v[7]=(float)fs.gy/meanDirThreshold;
+	v[8]=(float)fs.by/meanDirThreshold;
+	for(int a=0;a<12;++a)
+		v[9+a]=quads[a]*4.0f/meanThreshold;
 
-	for(int a=0;a<internalTiles;++a){
-		tf.write(newTiles[a],SMALL_TILE_SIZE);
-		delete[] newTiles[a];
+	for(int t=0;t<LSH_TABLES;++t){
+		unsigned long long key=14695981039346656037ULL;
+		for(int p=0;p<LSH_PROJECTIONS;++p){
+			const float* proj=&lshProjections[(t*LSH_PROJECTIONS+p)*LSH_DIMS];
+			float dot=lshOffsets[t*LSH_PROJECTIONS+p];
+			for(int a=0;a<LSH_DIMS;++a)
+				dot+=proj[a]*v[a];
+			key^=(unsigned long long)(long long)floorf(dot/LSH_BUCKET_WIDTH);
+			key*=1099511628211ULL;
+		}
+		keys[t]=key;
 	}
 }
 
-void CTileHandler::ReadTile(int xpos, int ypos, char *destbuf, char *sourcebuf)
+void CTileHandler::CalcCompressedStat(const unsigned char* blocks,int blockStride,FastStat& fs,unsigned char* data)
 {
-	int doffset = 0;
-	int soffset = 0;
+	//gives the same stats and data as CreateFromDXT1 followed by CalcFastStat and ExtractMatchData
+	//without writing out the pixels, blocks points at the first level 0 block of the tile and
+	//blockStride is the number of blocks per row in that buffer
+	unsigned char palette[64][4][3];
+	unsigned int indices[64];
+	int quads[12];
+	memset(quads,0,sizeof(quads));
 
-	for(int i=0; i<4; i++)
-	{
-		int div = 1<<i;
-		int xp = 8/div;
-		int yp = 8/div;
-		for(int y=0; y<yp; y++)
-		{
-			for(int x=0; x<xp; x++)
-			{
-				char *destptr = &destbuf[(x+y*xp)*8 + doffset];
-				char *srcptr = &sourcebuf[((x+xpos/div/4)+((y+ypos/div/4))*(256/(div)))*8 + soffset];
+	fs.r=fs.g=fs.b=0;
+	fs.rx=fs.gx=fs.bx=0;
+	fs.ry=fs.gy=fs.by=0;
 
-				for(int i=0; i<8; i++)
-					destptr[i] = srcptr[i];
+	for(int by=0;by<8;++by){
+		for(int bx=0;bx<8;++bx){
+			const unsigned char* block=&blocks[(by*blockStride+bx)*8];
+			unsigned char (*pal)[3]=palette[by*8+bx];
+			indices[by*8+bx]=DecodeBlockPalette(block,pal);
+
+			//CreateFromDXT1 shifts the index bits before reading them, so pixel n
+			//uses the index of pixel n+1 and the last pixel always uses index 0
+			int count[4]={0,0,0,0};
+			int xsum[4]={0,0,0,0};
+			int ysum[4]={0,0,0,0};
+			unsigned int bits=indices[by*8+bx];
+			for(int n=0;n<16;++n){
+				bits>>=2;
+				int code=bits&3;
+				count[code]++;
+				xsum[code]+=bx*4+(n&3)-16;
+				ysum[code]+=by*4+(n>>2)-16;
+			}
+			for(int code=0;code<4;++code){
+				if(count[code]==0)
+					continue;
+				fs.r+=pal[code][0]*count[code];
+				fs.g+=pal[code][1]*count[code];
+				fs.b+=pal[code][2]*count[code];
+				fs.rx+=pal[code][0]*xsum[code];
+				fs.gx+=pal[code][1]*xsum[code];
+				fs.bx+=pal[code][2]*xsum[code];
+				fs.ry+=pal[code][0]*ysum[code];
+				fs.gy+=pal[code][1]*ysum[code];
+				fs.by+=pal[code][2]*ysum[code];
+				for(int c=0;c<3;++c)
+					quads[((by/4)*2+bx/4)*3+c]+=pal[code][c]*count[code];
 			}
 		}
-		doffset += 512/(1<<(i*2));
-		soffset += 524288/(1<<(i*2));
 	}
+
+	//the border metric only needs the outer ring, so avoid writing out the other pixels
+	if(tileMetric==METRIC_BORDER){
+		int n=0;
+		for(int y=0;y<32;++y){
+			for(int x=0;x<32;++x){
+				if(!(y==0 || y==31 || x==0 || x==31))
+					continue;
+				int blockNum=(y/4)*8+x/4;
+				int pixel=(y&3)*4+(x&3);
+				int code=pixel==15 ? 0 : (indices[blockNum]>>((pixel+1)*2))&3;
+				data[n++]=palette[blockNum][code][0];
+				data[n++]=palette[blockNum][code][1];
+				data[n++]=palette[blockNum][code][2];
+			}
+		}
+		memset(data+n,0,TILE_BORDER_SIZE-n);
+		if(tileMatcher==MATCHER_LSH)
+			memcpy(data+matchDataSize-TILE_SKETCH_SIZE,quads,TILE_SKETCH_SIZE);
+		return;
+	}
+
+	unsigned char rgba[32*32*4];
+	for(int y=0;y<32;++y){
+		for(int x=0;x<32;++x){
+			int blockNum=(y/4)*8+x/4;
+			int pixel=(y&3)*4+(x&3);
+			int code=pixel==15 ? 0 : (indices[blockNum]>>((pixel+1)*2))&3;
+			rgba[(y*32+x)*4+0]=palette[blockNum][code][0];
+			rgba[(y*32+x)*4+1]=palette[blockNum][code][1];
+			rgba[(y*32+x)*4+2]=palette[blockNum][code][2];
+			rgba[(y*32+x)*4+3]=0;
+		}
+	}
+	ExtractMatchData(rgba,data);
 }
 
-int CTileHandler::FindCloseTile(CBitmap* bm,int forbidden)
+void CTileHandler::CalcBlockFeature(const unsigned char* blocks,int blockStride,unsigned char* feature)
 {
-	FastStat fs=CalcFastStat(bm);
-	for(int a=0;a<usedTiles;++a){
-		if(a!=forbidden &&
-			abs(fs.r-fastStats[a].r)<meanThreshold && abs(fs.g-fastStats[a].g)<meanThreshold && abs(fs.b-fastStats[a].b)<meanThreshold
-		&& abs(fs.rx-fastStats[a].rx)<meanDirThreshold && abs(fs.gx-fastStats[a].gx)<meanDirThreshold && abs(fs.bx-fastStats[a].bx)<meanDirThreshold
-		&& abs(fs.ry-fastStats[a].ry)<meanDirThreshold && abs(fs.gy-fastStats[a].gy)<meanDirThreshold && abs(fs.by-fastStats[a].by)<meanDirThreshold
-		&& CompareTiles(bm,tiles[a]))
-			return a;
+	//mean colour of each level 0 block as CreateFromDXT1 would decode it, rounded to bytes
+	for(int by=0;by<8;++by){
+		for(int bx=0;bx<8;++bx){
+			unsigned char pal[4][3];
+			unsigned int bits=DecodeBlockPalette(&blocks[(by*blockStride+bx)*8],pal);
+			int count[4]={0,0,0,0};
+			for(int n=0;n<16;++n){
+				bits>>=2;
+				count[bits&3]++;
+			}
+			for(int c=0;c<3;++c){
+				int sum=pal[0][c]*count[0]+pal[1][c]*count[1]+pal[2][c]*count[2]+pal[3][c]*count[3];
+				feature[(by*8+bx)*3+c]=(sum+8)/16;
+			}
+		}
 	}
-	fastStats[usedTiles]=fs;
-	return -1;
 }
 
-
 CTileHandler::FastStat CTileHandler::CalcFastStat(CBitmap* bm)
+{
+#ifdef TILEHANDLER_SSE2
+	return CalcFastStatSSE2(bm);
+#else
+	return CalcFastStatRef(bm);
+#endif
+}
+
+bool CTileHandler::CompareTiles(const unsigned char* data, const unsigned char* data2, const Thresholds& th)
+{
+	if((tileMetric==METRIC_FULL || tileMetric==METRIC_YCOCG) && th.mean>0 && !CompareCoarse(data,data2,th))
+		return false;
+#ifdef TILEHANDLER_SSE2
+	return CompareTilesSSE2(data,data2,th);
+#else
+	return CompareTilesRef(data,data2,th);
+#endif
+}
+
+//plain versions, the sse2 ones below must give exactly the same results
+CTileHandler::FastStat CTileHandler::CalcFastStatRef(CBitmap* bm)
 {
 	FastStat fs;
 	fs.r=0;
@@ -309,25 +2634,274 @@ CTileHandler::FastStat CTileHandler::CalcFastStat(CBitmap* bm)
 	return fs;
 }
 
-bool CTileHandler::CompareTiles(CBitmap* bm, CBitmap* bm2)
+bool CTileHandler::CompareCoarse(const unsigned char* data, const unsigned char* data2, const Thresholds& th)
+{
+#ifdef TILEHANDLER_SSE2
+	return CompareCoarseSSE2(data,data2,th);
+#else
+	return CompareCoarseRef(data,data2,th);
+#endif
+}
+
+bool CTileHandler::CompareCoarseRef(const unsigned char* data, const unsigned char* data2, const Thresholds& th)
+{
+	//the squared error of the sums of n pixels divided by n is never more than the squared
+	//error of the pixels themselves, so a tile failing on the 8x8 or 4x4 cells would fail
+	//on all pixels too and the cells can be tested first without changing the result
+	const unsigned short* coarse=(const unsigned short*)(data+TILE_PIXELS_SIZE);
+	const unsigned short* coarse2=(const unsigned short*)(data2+TILE_PIXELS_SIZE);
+	int lumaWeight=tileMetric==METRIC_YCOCG ? 3 : 1;
+	for(int level=0;level<2;++level){
+		int firstCell=level==0 ? 0 : 16;
+		int numCells=level==0 ? 16 : 64;
+		long long pixels=level==0 ? 64 : 16;
+		long long totalerror=0;
+		for(int a=firstCell;a<firstCell+numCells;++a){
+			long long d0=coarse[a*3+0]-coarse2[a*3+0];
+			long long d1=coarse[a*3+1]-coarse2[a*3+1];
+			long long d2=coarse[a*3+2]-coarse2[a*3+2];
+			totalerror+=d0*d0*lumaWeight+d1*d1+d2*d2;
+		}
+		if(totalerror>th.match*pixels)
+			return false;
+	}
+	return true;
+}
+
+bool CTileHandler::CompareTilesRef(const unsigned char* data, const unsigned char* data2, const Thresholds& th)
+{
+	if (th.mean<=0) return false;
+	int totalerror=0;
+	switch(tileMetric){
+	case METRIC_BORDER:
+		for(int a=0;a<TILE_BORDER_PIXELS*3;++a){
+			int dif=data[a]-data2[a];
+			totalerror+=dif*dif;
+			if(a%96==95 && totalerror>th.match)
+				return false;
+		}
+		break;
+	case METRIC_FULL:
+	case METRIC_YCOCG:
+		for(int y=0;y<32;++y){
+			for(int a=y*128;a<y*128+128;++a){
+				int dif=data[a]-data2[a];
+				int weight=(tileMetric==METRIC_YCOCG && (a&3)==0) ? 3 : 1;
+				totalerror+=dif*dif*weight;
+			}
+			if(totalerror>th.match)
+				return false;
+		}
+		break;
+	case METRIC_MAXBLOCK:
+		for(int by=0;by<8;++by){
+			for(int bx=0;bx<8;++bx){
+				int blockerror=0;
+				for(int y=by*4;y<by*4+4;++y){
+					for(int a=(y*32+bx*4)*4;a<(y*32+bx*4+4)*4;++a){
+						int dif=data[a]-data2[a];
+						blockerror+=dif*dif;
+					}
+				}
+				if(blockerror>th.match)
+					return false;
+			}
+		}
+		break;
+	}
+	return totalerror<=th.match;
+}
+
+int CTileHandler::TileError(const unsigned char* data, const unsigned char* data2)
 {
-	if (meanThreshold<=0) return false;
+	//the error CompareTilesRef tests, without stopping early
 	int totalerror=0;
+	switch(tileMetric){
+	case METRIC_BORDER:
+		for(int a=0;a<TILE_BORDER_PIXELS*3;++a){
+			int dif=data[a]-data2[a];
+			totalerror+=dif*dif;
+		}
+		break;
+	case METRIC_FULL:
+	case METRIC_YCOCG:
+		for(int a=0;a<TILE_PIXELS_SIZE;++a){
+			int dif=data[a]-data2[a];
+			int weight=(tileMetric==METRIC_YCOCG && (a&3)==0) ? 3 : 1;
+			totalerror+=dif*dif*weight;
+		}
+		break;
+	case METRIC_MAXBLOCK:
+		for(int by=0;by<8;++by){
+			for(int bx=0;bx<8;++bx){
+				int blockerror=0;
+				for(int y=by*4;y<by*4+4;++y){
+					for(int a=(y*32+bx*4)*4;a<(y*32+bx*4+4)*4;++a){
+						int dif=data[a]-data2[a];
+						blockerror+=dif*dif;
+					}
+				}
+				totalerror=max(totalerror,blockerror);
+			}
+		}
+		break;
+	}
+	return totalerror;
+}
+
+#ifdef TILEHANDLER_SSE2
+CTileHandler::FastStat CTileHandler::CalcFastStatSSE2(CBitmap* bm)
+{
+	//sum the columns and rows first and weight the sums afterwards,
+	//a column or row sum of one channel is at most 32*255 so it fits in 16 bits
+	const __m128i zero=_mm_setzero_si128();
+	__m128i colSum[16];		//16 bit rgba of pixel 2*i and 2*i+1 summed over all rows
+	for(int i=0;i<16;++i)
+		colSum[i]=zero;
+	__m128i total=zero;		//32 bit rgba
+	__m128i yWeighted=zero;
+
 	for(int y=0;y<32;++y){
-		for(int x=0;x<32;++x){
-			if(!(y==0 || y==31 || x==0 || x==31))
-				continue;
-			int rdif=bm->mem[(y*32+x)*4+0]-bm2->mem[(y*32+x)*4+0];
-			int gdif=bm->mem[(y*32+x)*4+1]-bm2->mem[(y*32+x)*4+1];
-			int bdif=bm->mem[(y*32+x)*4+2]-bm2->mem[(y*32+x)*4+2];
-			int error=rdif*rdif+gdif*gdif+bdif*bdif;
-			totalerror+=error;
+		const __m128i* row=(const __m128i*)&bm->mem[y*32*4];
+		__m128i rowSum=zero;
+		for(int i=0;i<8;++i){
+			__m128i p=_mm_loadu_si128(row+i);
+			__m128i lo=_mm_unpacklo_epi8(p,zero);
+			__m128i hi=_mm_unpackhi_epi8(p,zero);
+			colSum[i*2]=_mm_add_epi16(colSum[i*2],lo);
+			colSum[i*2+1]=_mm_add_epi16(colSum[i*2+1],hi);
+			rowSum=_mm_add_epi16(rowSum,_mm_add_epi16(lo,hi));
 		}
-		if(totalerror>borderThreshold)
-			return false;
+		rowSum=_mm_add_epi32(_mm_unpacklo_epi16(rowSum,zero),_mm_unpackhi_epi16(rowSum,zero));
+		total=_mm_add_epi32(total,rowSum);
+		//madd against (weight,0) pairs multiplies each 32 bit lane by the weight
+		yWeighted=_mm_add_epi32(yWeighted,_mm_madd_epi16(rowSum,_mm_set1_epi32((unsigned short)(y-16))));
+	}
+
+	__m128i xWeighted=zero;
+	for(int i=0;i<16;++i){
+		__m128i lo=_mm_unpacklo_epi16(colSum[i],zero);
+		__m128i hi=_mm_unpackhi_epi16(colSum[i],zero);
+		xWeighted=_mm_add_epi32(xWeighted,_mm_madd_epi16(lo,_mm_set1_epi32((unsigned short)(i*2-16))));
+		xWeighted=_mm_add_epi32(xWeighted,_mm_madd_epi16(hi,_mm_set1_epi32((unsigned short)(i*2+1-16))));
+	}
+
+	int t[4],xw[4],yw[4];
+	_mm_storeu_si128((__m128i*)t,total);
+	_mm_storeu_si128((__m128i*)xw,xWeighted);
+	_mm_storeu_si128((__m128i*)yw,yWeighted);
+
+	FastStat fs;
+	fs.r=t[0];
+	fs.g=t[1];
+	fs.b=t[2];
+
+	fs.rx=xw[0];
+	fs.gx=xw[1];
+	fs.bx=xw[2];
+
+	fs.ry=yw[0];
+	fs.gy=yw[1];
+	fs.by=yw[2];
+	return fs;
+}
+
+static inline int HorizontalSum(__m128i v)
+{
+	v=_mm_add_epi32(v,_mm_shuffle_epi32(v,_MM_SHUFFLE(1,0,3,2)));
+	v=_mm_add_epi32(v,_mm_shuffle_epi32(v,_MM_SHUFFLE(2,3,0,1)));
+	return _mm_cvtsi128_si32(v);
+}
+
+//weighted squared difference of 16 bytes, summed into 4 lanes
+static inline __m128i SquaredError(const unsigned char* data, const unsigned char* data2, __m128i weight)
+{
+	const __m128i zero=_mm_setzero_si128();
+	__m128i p1=_mm_loadu_si128((const __m128i*)data);
+	__m128i p2=_mm_loadu_si128((const __m128i*)data2);
+	__m128i lo=_mm_sub_epi16(_mm_unpacklo_epi8(p1,zero),_mm_unpacklo_epi8(p2,zero));
+	__m128i hi=_mm_sub_epi16(_mm_unpackhi_epi8(p1,zero),_mm_unpackhi_epi8(p2,zero));
+	return _mm_add_epi32(_mm_madd_epi16(_mm_mullo_epi16(lo,weight),lo),_mm_madd_epi16(_mm_mullo_epi16(hi,weight),hi));
+}
+
+bool CTileHandler::CompareCoarseSSE2(const unsigned char* data, const unsigned char* data2, const Thresholds& th)
+{
+	//same test as CompareCoarseRef, the differences of the 8x8 cells are divided by 4 so
+	//their squares fit in 32 bits which only makes the bound smaller
+	const __m128i* coarse=(const __m128i*)(data+TILE_PIXELS_SIZE);
+	const __m128i* coarse2=(const __m128i*)(data2+TILE_PIXELS_SIZE);
+	__m128i weight[3];
+	if(tileMetric==METRIC_YCOCG){
+		//cells are 3 shorts so the luma weight repeats every 3 vectors
+		weight[0]=_mm_set_epi16(1,3,1,1,3,1,1,3);
+		weight[1]=_mm_set_epi16(3,1,1,3,1,1,3,1);
+		weight[2]=_mm_set_epi16(1,1,3,1,1,3,1,1);
+	} else {
+		weight[0]=weight[1]=weight[2]=_mm_set1_epi16(1);
+	}
+
+	__m128i error=_mm_setzero_si128();
+	for(int a=0;a<TILE_COARSE_SIZE/16;++a){
+		__m128i c1=_mm_loadu_si128(coarse+a);
+		__m128i c2=_mm_loadu_si128(coarse2+a);
+		__m128i dif=_mm_or_si128(_mm_subs_epu16(c1,c2),_mm_subs_epu16(c2,c1));
+		if(a<6)
+			dif=_mm_srli_epi16(dif,2);
+		error=_mm_add_epi32(error,_mm_madd_epi16(_mm_mullo_epi16(dif,weight[a%3]),dif));
+		if(a==5){
+			//16 cells of 64 pixels with (dif/4)^2*16<=dif^2
+			if((long long)HorizontalSum(error)*16>(long long)th.match*64)
+				return false;
+			error=_mm_setzero_si128();
+		}
+	}
+	//64 cells of 16 pixels, each lane is below 2^31 but their sum might not be
+	int lanes[4];
+	_mm_storeu_si128((__m128i*)lanes,error);
+	return (long long)lanes[0]+lanes[1]+lanes[2]+lanes[3]<=(long long)th.match*16;
+}
+
+bool CTileHandler::CompareTilesSSE2(const unsigned char* data, const unsigned char* data2, const Thresholds& th)
+{
+	//the error only grows so checking it less often gives the same answer
+	if (th.mean<=0) return false;
+	__m128i error=_mm_setzero_si128();
+	__m128i weight=_mm_set1_epi16(1);
+	switch(tileMetric){
+	case METRIC_BORDER:
+		for(int a=0;a<TILE_BORDER_SIZE;a+=16){
+			error=_mm_add_epi32(error,SquaredError(data+a,data2+a,weight));
+			if((a&127)==112 && HorizontalSum(error)>th.match)
+				return false;
+		}
+		break;
+	case METRIC_YCOCG:
+		weight=_mm_set_epi16(1,1,1,3,1,1,1,3);
+		//fall through
+	case METRIC_FULL:
+		for(int a=0;a<TILE_PIXELS_SIZE;a+=16){
+			error=_mm_add_epi32(error,SquaredError(data+a,data2+a,weight));
+			if((a&127)==112 && HorizontalSum(error)>th.match)
+				return false;
+		}
+		break;
+	case METRIC_MAXBLOCK:
+		for(int by=0;by<8;++by){
+			for(int bx=0;bx<8;++bx){
+				int a=(by*4*32+bx*4)*4;
+				__m128i blockerror=SquaredError(data+a,data2+a,weight);
+				blockerror=_mm_add_epi32(blockerror,SquaredError(data+a+128,data2+a+128,weight));
+				blockerror=_mm_add_epi32(blockerror,SquaredError(data+a+256,data2+a+256,weight));
+				blockerror=_mm_add_epi32(blockerror,SquaredError(data+a+384,data2+a+384,weight));
+				if(HorizontalSum(blockerror)>th.match)
+					return false;
+			}
+		}
+		break;
 	}
 	return true;
 }
+#endif
 
 int CTileHandler::GetFileSize(void)
 {
@@ -337,7 +2911,12 @@ int CTileHandler::GetFileSize(void)
 		size+=5;		//overhead per file (including 0 termination of string)
 		size+=(int)fi->size();		//size for filename
 	}
-	size+=(int)myTileFile.size()+5;	//size and overhead of new tilefile name
+	if(UseShards()){
+		for(int k=0;k<numShards;++k)
+			size+=(int)ShardFileName(k).size()+5;
+	} else {
+		size+=(int)myTileFile.size()+5;	//size and overhead of new tilefile name
+	}
 	return size;
 }
 
@@ -350,3 +2929,10 @@ void CTileHandler::SetOutputFile(string file)
 {
 	myTileFile=file.substr(0,file.find_last_of('.'))+".smt";
 }
+
+void CTileHandler::SetTileLibrary(string file)
+{
+	//the new tiles go into the library instead of a tile file of their own
+	tileLibrary=file;
+	myTileFile=file;
+}
@@ -2,14 +2,81 @@
 #define __TILEHANDLER_H__
 
 #include <vector>
+#include <map>
 #include <string>
 #include <fstream>
 #include "Bitmap.h"
+#include <boost/thread/mutex.hpp>
+
+namespace boost { class thread_group; }
 
 using namespace std;
 
-#define MAX_MAP_SIZE 40					//increase maybe
-#define MAX_TILES (MAX_MAP_SIZE*MAX_MAP_SIZE*16*16)
+class CMappedFile;
+
+#define TILE_BORDER_PIXELS 124			//outer ring of a 32x32 tile
+#define TILE_BORDER_SIZE 384			//rgb of the border pixels padded to a multiple of 16
+#define TILE_PIXELS_SIZE 4096			//all 32x32 pixels with 4 bytes each
+#define TILE_COARSE_SIZE 480			//rgb sums of 4x4 cells of 8x8 pixels then 8x8 cells of 4x4 pixels as shorts
+#define TILE_SKETCH_SIZE 48			//rgb sums of the four 16x16 quadrants as ints, for the lsh matcher
+#define TILE_MATCH_SIZE (TILE_PIXELS_SIZE+TILE_COARSE_SIZE+TILE_SKETCH_SIZE)	//largest matchDataSize
+#define MIN_COMPRESS_FACTOR 0.001f		//range searched for a tile budget, the smallest still merges exact duplicates
+#define MAX_COMPRESS_FACTOR 1000.0f		//and the largest keeps the thresholds from overflowing
+#define TILE_FEATURE_SIZE 192			//mean rgb of the 64 4x4 blocks, what cluster mode compares
+#define CLUSTER_ITERATIONS 50			//mini batches run before the final assignment
+#define CLUSTER_BATCH_SIZE 8192			//tiles sampled per mini batch
+
+//how CompareTiles measures the difference between two tiles
+enum TileMetric{
+	METRIC_BORDER,		//squared rgb error of the border pixels
+	METRIC_FULL,		//squared rgb error of all pixels
+	METRIC_YCOCG,		//squared YCoCg error of all pixels with luma weighted 3:1:1
+	METRIC_MAXBLOCK		//squared rgb error of the worst 4x4 block
+};
+
+//how FindCloseTile finds the candidates it passes to CompareTiles
+enum TileMatcher{
+	MATCHER_EXACT,		//every tile in the surrounding mean colour cells
+	MATCHER_LSH		//tiles sharing a bucket in one of the lsh tables, may miss some
+};
+#define LSH_TABLES 8				//more tables find more of the close tiles
+#define LSH_PROJECTIONS 4			//more projections per table give fewer far candidates
+#define LSH_DIMS 21				//FastStat and the quadrant sums, scaled by the thresholds
+#define LSH_BUCKET_WIDTH 8.0f			//in units of the thresholds
+#define TILE_CACHE_SIZE 8			//recently matched tiles tried before a search
+#define TILE_CACHE_RUN 64			//tiles along the curve per run of the parallel stage
+
+//order of the new tiles in the .smt
+enum TileOrder{
+	ORDER_DISCOVERY,	//as they are created, big square by big square
+	ORDER_MORTON,		//by first use along a morton curve over the map
+	ORDER_HILBERT		//by first use along a hilbert curve over the map
+};
+#define TILE_BENCH_MIN_VIEW 8			//sides in tiles of the rectangles BenchmarkTileReads reads
+#define TILE_BENCH_MAX_VIEW 48
+#define KERNEL_BENCH_CALLS 1000000		//calls of each kernel BenchmarkKernels times, spread over its tiles
+#define TILE_STATS_BUCKETS 10			//match error histogram buckets between 0 and matchThreshold
+#define COMPRESS_RETRIES 2			//times a big square is given to the external compressor again after it failed
+
+//index next to a tile library .smt, one fixed size record per tile follows the header, each
+//a 64 bit hash of the compressed tile, its FastStat, 4 bytes padding and matchDataSize bytes
+//of match data, so records can be appended and the file mapped as it is
+struct TileIndexHeader
+{
+	char magic[16];		//"mapconv tileidx\0"
+	int version;		//1
+	int numTiles;		//must equal the number of tiles in the .smt
+	int tileMetric;		//the match data is only valid for the same metric,
+	int tileMatcher;	//matcher
+	int matchDataSize;	//and size
+	int recordSize;
+};
+#define TILE_INDEX_RECORD_HEADER 48
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#define TILEHANDLER_SSE2
+#include <emmintrin.h>
+#endif
 
 class CTileHandler
 {
@@ -17,11 +84,22 @@ public:
 	CTileHandler();
 	~CTileHandler(void);
 	void LoadTexture(string name);
-	void ProcessTiles(float compressFactor, bool fastcompress);
+	bool ProcessTiles(float compressFactor, bool fastcompress);	//false if the tile library couldnt be loaded or the texture compressed
+	void SetCompressFactor(float compressFactor);
+	bool SetTileMetric(string name);
+	bool SetTileMatcher(string name);
+	bool SetTileOrder(string name);
+	void SetMatchDataSize(void);
 	void SaveData(ofstream& ofs);
 	void ReadTile(int xpos, int ypos, char *destbuf, char *sourcebuf);
-	int FindCloseTile(CBitmap* bm,int forbidden);
+	unsigned long long HashTile(int xpos, int ypos, char *sourcebuf);
+	unsigned long long HashTileData(const char* tile);
 	void ProcessTiles2(void);
+	void ReadBigSquare(int num, char* bigtile);
+	void MatchSquare(int num, char* bigtile);
+	void PrepareSquareTiles(int thread);
+	void DecodeSquareTile(int b);
+	void ResetTiles(void);
 
 	int GetFileSize(void);
 	void AddExternalTileFile(string file);
@@ -31,9 +109,8 @@ public:
 	int xsize;
 	int ysize;
 
-	CBitmap* tiles[MAX_TILES];
-	vector<char*> newTiles;
-	int tileUse[MAX_TILES];
+	vector<char> newTiles;			//SMALL_TILE_SIZE bytes per new tile
+	vector<int> tileUse;
 	int usedTiles;
 	int numExternalTile;
 
@@ -42,17 +119,279 @@ public:
 		int rx,gx,bx;
 		int ry,gy,by;
 	};
-	FastStat fastStats[MAX_TILES];
+	//all matching needs of a tile is its stats and the pixels the metric looks at
+	//(matchDataSize bytes), kept in flat arrays instead of a decoded bitmap per tile,
+	//the full tile metrics follow the pixels with the coarse cell sums and the lsh
+	//matcher puts the quadrant sums last
+	vector<FastStat> fastStats;
+	vector<unsigned char> tileMatchData;
+	int tileMetric;
+	int matchDataSize;
+
+	//the thresholds one search compares with, the ones below scaled for the tile searched for
+	struct Thresholds{
+		int mean;
+		int meanDir;
+		int match;
+	};
+	Thresholds ScaledThresholds(int level);
+
+	//what a search looked at, only counted when recordStats is set
+	struct SearchStats{
+		int candidates;		//tiles in the searched cells or buckets
+		int rejected;		//of those failing CompareFastStat
+		int compares;		//CompareTiles calls
+	};
+	int FindCloseTile(const FastStat& fs,const unsigned char* data,int forbidden,int startTile,int endTile,const Thresholds& th,SearchStats* stats,vector<int>& candidates);
+	vector<vector<int> > searchCandidates;	//scratch of FindCloseTile for each thread, the serial pass uses thread 0s
+	const unsigned char* TileMatchData(int tile,unsigned char* buf);
+	int AddTile(const FastStat& fs,const unsigned char* data);
+	void ExtractMatchData(const unsigned char* rgba,unsigned char* data);
+	void ExtractSketch(const unsigned char* rgba,unsigned char* data);
+	void CalcCompressedStat(const unsigned char* blocks,int blockStride,FastStat& fs,unsigned char* data);
+
 	FastStat CalcFastStat(CBitmap* bm);
-	bool CompareTiles(CBitmap* bm, CBitmap* bm2);
+	FastStat CalcFastStatRef(CBitmap* bm);
+	bool CompareFastStat(const FastStat& fs, const FastStat& fs2, const Thresholds& th);
+	bool CompareTiles(const unsigned char* data, const unsigned char* data2, const Thresholds& th);
+	bool CompareCoarse(const unsigned char* data, const unsigned char* data2, const Thresholds& th);
+	bool CompareCoarseRef(const unsigned char* data, const unsigned char* data2, const Thresholds& th);
+	bool CompareTilesRef(const unsigned char* data, const unsigned char* data2, const Thresholds& th);
+	int TileError(const unsigned char* data, const unsigned char* data2);
+#ifdef TILEHANDLER_SSE2
+	FastStat CalcFastStatSSE2(CBitmap* bm);
+	bool CompareCoarseSSE2(const unsigned char* data, const unsigned char* data2, const Thresholds& th);
+	bool CompareTilesSSE2(const unsigned char* data, const unsigned char* data2, const Thresholds& th);
+#endif
+
+	//grid over the mean colour of the tiles, each cell is meanThreshold wide so
+	//every tile that can pass the mean test lies in one of the 27 surrounding cells
+	map<long long,vector<int> > statIndex;
+	long long StatCell(int r,int g,int b);
+	void IndexTile(int tile);
+
+	//lsh matcher, each table hashes LSH_PROJECTIONS random projections of the scaled
+	//stats and quadrant sums of a tile, quantized to LSH_BUCKET_WIDTH
+	int tileMatcher;
+	vector<float> lshProjections;		//LSH_TABLES*LSH_PROJECTIONS*LSH_DIMS
+	vector<float> lshOffsets;		//LSH_TABLES*LSH_PROJECTIONS
+	map<unsigned long long,vector<int> > lshTables[LSH_TABLES];
+	void InitLsh(void);
+	void LshKeys(const FastStat& fs,const unsigned char* data,unsigned long long* keys);
+	//with checkLshRecall every lsh search is repeated by a linear scan to count how
+	//many of the searches that have a close tile the lsh tables find one for
+	bool checkLshRecall;
+	int lshSearches;
+	int lshFound;
+	boost::mutex lshRecallMutex;
 
+	//result of the last full search for each distinct compressed tile, tiles below
+	//tile except skipped (the forbidden tile at that time) are known not to match
+	//with the thresholds of mask value level, -1 if the result holds for any
+	struct DuplicateTile{
+		int tile;
+		int skipped;
+		int level;
+	};
+	map<unsigned long long,DuplicateTile> duplicateTiles;
+	int numDuplicateTiles;
+
+	//per tile work done in parallel for the current big square, match is the first
+	//close tile below squareStartTile, -1 if there is none and -2 if not searched yet,
+	//unless cached is set and it is just some close tile found in the neighbour cache
+	struct SquareTile{
+		unsigned long long hash;
+		bool decoded;
+		FastStat fs;
+		unsigned char matchData[TILE_MATCH_SIZE];
+		int match;
+		bool cacheLookup;
+		bool cached;
+		int level;			//mask value
+		SearchStats stats;
+	};
+	vector<SquareTile> squareTiles;
+	char* curBigTile;
+	int curSquare;
+	int squareStartTile;
+	int numThreads;
+
+	//neighbour cache, the tiles of a big square are visited along a hilbert curve and the
+	//tiles used by the neighbours and the last few matches are tried before a full search
+	bool neighbourCache;
+	vector<int> squareOrder;		//tile numbers of a big square in visiting order
+	int cacheLookups;
+	int cacheHits;
+	void SetSquareOrder(void);
+	int ProbeTileCache(const FastStat& fs,const unsigned char* data,const int* cache,int cacheSize,int forbidden,int startTile,int endTile,const Thresholds& th,SearchStats* stats);
+
+	//tile budget mode, the stats, match data and hash of every tile in the map are
+	//decoded once and the compress factor is searched by matching only those
+	int maxNewTiles;				//0 means no budget
+	vector<unsigned long long> cachedHashes;
+	vector<FastStat> cachedStats;
+	vector<unsigned char> cachedMatchData;
+	void FitTileBudget(void);
+	void CacheSignatures(void);
+	void CacheSquareSignatures(int thread);
+	int CountNewTiles(float compressFactor);
+
+	//cluster mode, instead of merging tiles one by one every tile is mapped to one of
+	//clusterTiles representatives found by mini batch k-means over the block colours,
+	//the representative of a cluster is the real tile closest to its centre
+	int clusterTiles;				//0 means the greedy matching
+	vector<unsigned long long> clusterHashes;	//per tile in the map
+	vector<int> clusterFirstTile;			//first tile of each distinct compressed tile
+	vector<int> clusterTileDistinct;		//distinct tile of each tile
+	vector<unsigned char> clusterFeatures;		//TILE_FEATURE_SIZE bytes per distinct tile
+	vector<unsigned char> squareFeatures;		//of the tiles in the current big square
+	vector<float> clusterCenters;			//TILE_FEATURE_SIZE floats per cluster
+	vector<int> centerOrder;			//clusters sorted by the sum of their centre
+	vector<float> centerSums;			//and those sums
+	vector<float> centerQuads;			//rgb sums of the four quadrants in the same order
+	vector<int> clusterPoints;			//distinct tiles to assign on the threads
+	vector<int> pointCluster;
+	vector<float> pointDist;
+	void ClusterTiles(void);
+	void CacheSquareFeatures(int thread);
+	void CalcBlockFeature(const unsigned char* blocks,int blockStride,unsigned char* feature);
+	void SortCenters(void);
+	int NearestCenter(const unsigned char* feature,float& bestDist);
+	void AssignClusterPoints(int thread);
+
+	float compressFactor;
 	int meanThreshold;
 	int meanDirThreshold;
 	int borderThreshold;
+	int matchThreshold;		//borderThreshold scaled to the number of pixels tileMetric compares
+
+	//optional mask with one value per tile scaling the thresholds by value/128, so a tile can
+	//be merged harder or softer than -c says, empty when every tile uses the thresholds above
+	vector<unsigned char> tileMask;
+	void LoadTileMask(string name);
+	int MaskLevel(int square,int b);
 
 	vector<string> externalFiles;
 	vector<int> externalFileTileSize;
 
+	//external files are mapped instead of read, their stats are computed on the threads or taken
+	//from an index next to the file and their tiles are only decoded the first time they are
+	//compared, so their match data is not in tileMatchData which starts at tile numLazyTiles
+	vector<CMappedFile*> mappedFiles;
+	vector<const char*> lazyTiles;		//compressed data of each external tile
+	vector<vector<unsigned char> > lazyMatchData;	//and its match data once it was decoded
+	boost::mutex lazyMutex;
+	int numLazyTiles;
+	const char* curExternalTiles;
+	int curExternalFirstTile;
+	int curExternalNumTiles;
+	void LoadExternalFile(string file);
+	void CalcExternalStats(int thread);
+
+	//tile library, an .smt shared by several maps that is loaded after the external files and
+	//gets the new tiles of this map appended, its index keeps the hash, stats and match data of
+	//every tile so they are not decoded again and exact duplicates are found by hash
+	string tileLibrary;
+	int numLibraryTiles;
+	vector<unsigned long long> libraryHashes;
+	void SetTileLibrary(string file);
+	bool LoadTileLibrary(void);
+	bool LoadTileIndex(int numTiles);
+	void AppendTileIndex(const char* tiles,int numTiles,int oldTiles);
+	void AppendToTileLibrary(void);
+	void AddLibraryDuplicates(void);
+	string TileIndexName(void);
+
+	int tileOrder;
+	void OrderNewTiles(void);
+	void BenchmarkTileReads(int numViews);
+	void BenchmarkKernels(int numTiles);
+
+	//tile stats, with tileStatsName set the final matching pass records what each map tile
+	//searched and the error to the tile it got, then writes a heatmap and a summary
+	string tileStatsName;
+	bool recordStats;
+	vector<SearchStats> tileSearchStats;
+	vector<int> tileMatchError;		//-1 for new tiles
+	double prepareSeconds;			//time in the parallel stage of MatchSquare
+	double settleSeconds;			//and in the serial one
+	void RecordTileStats(int b,int index,int tile,bool isNew);
+	void SaveTileStats(void);
+
+	//extra compress factors matched in the same run from the same decoded tiles, each one
+	//saved into its own .smf and .smt after the main one
+	struct TileLevel{
+		float compressFactor;
+		int usedTiles;
+		vector<int> tileUse;
+		vector<char> newTiles;
+	};
+	vector<float> levelFactors;
+	vector<TileLevel> tileLevels;
+	void MatchLevels(void);
+	void UseLevel(int level);
+
+	//with numShards above 1 the new tiles are spread over that many .smt files, tile i of the
+	//map going to file i%numShards, which are written by one thread each after every big square
+	int numShards;
+	vector<ofstream*> shardFiles;
+	vector<int> shardOffsets;		//first tile of each shard among the new tiles, then the end
+	boost::thread_group* shardWriters;
+	int streamedTiles;			//new tiles handed to the shard threads so far
+	vector<char> pendingTiles;		//the ones they are writing now
+	int pendingFirst;
+	bool UseShards(void);
+	string ShardFileName(int shard);
+	void StartShards(void);
+	void WriteShards(void);
+	void WriteShardTiles(int shard);
+	void JoinShardWriters(void);
+	void FinishShards(void);
+
+	//quality of the built in dxt1 compressor used for the big squares and the minimap,
+	//-1 to run the external compressor given with -z or -q as before
+	int dxtQuality;
+	bool SetDxtQuality(string name);
+	int compressedSquares;			//progress of the compress threads
+	boost::mutex compressMutex;
+	void CopyBigSquare(int num,unsigned char* data);
+	void CompressBigSquares(int thread);
+
+	//rgba dedup, the tiles are cut straight from the texture and only the distinct ones are
+	//encoded, their stats come from the texture pixels and ReadBigSquare puts the big squares
+	//together from them, map tiles are numbered square*1024+tile like the cached signatures
+	bool rgbaDedup;
+	vector<int> rgbaTileIndex;		//distinct tile of every map tile
+	vector<int> rgbaSources;		//first map tile of every distinct tile
+	vector<unsigned long long> rgbaHashes;	//of the pixels of every map tile while deduping
+	vector<char> rgbaTiles;			//SMALL_TILE_SIZE bytes per distinct tile
+	vector<unsigned long long> rgbaTileHashes;	//HashTileData of those
+	vector<FastStat> rgbaStats;
+	vector<unsigned char> rgbaMatchData;
+	void DedupTilesRGBA(void);
+	void HashTilesRGBA(int thread);
+	void EncodeTilesRGBA(int thread);
+	const unsigned char* TilePixels(int n,int y);
+	bool SameTilePixels(int n,int n2);
+	void WriteTile(int xpos, int ypos, const char *sourcebuf, char *destbuf);
+
+	//stream hand-off, the -z compressor is run with --stream and gets the big squares over
+	//a pipe, the results stay in memory instead of going through temp files
+	bool streamCompressor;
+	vector<char> streamedSquares;		//696320 bytes per big square
+	bool StreamBigSquares(void);
+	void StreamJob(void);
+
+	//external compressor pool, compressJobs processes run at once and each gets one big square,
+	//0 runs the compressor once over all the temp files as before, with --stream it is the
+	//number of compressors fed at once
+	int compressJobs;
+	int nextSquare;				//next big square a compress job takes
+	int failedSquares;
+	bool streamFailed;
+	bool RunCompressJobs(bool fastcompress);
+	void CompressJob(bool fastcompress);
+
 	string myTileFile;
 };
 
@@ -38,15 +38,13 @@
 */
 
 /*
-** To get this code working you need to build the libtxc shared library
-** which is included in the DRI svn.
-**
-** compile libtxc and install it with 'make install' as root
-** before using this code
+** The dxt1 compression is done by CDxtCompressor, which is shared with
+** mapconv, so libtxc_dxtn is no longer needed.
 */
 
 #include <fstream>
 #include "Bitmap.h"
+#include "DxtCompressor.h"
 #include "texcompress_nogui.h"
 
 using namespace std;
@@ -55,20 +53,17 @@ void compressed_rgba_s3tc_dxt1_ext_software(int mipmaps,unsigned char *src, int
 
     int bpp = 4;
 
-    if (bpp >= 3)
-        swap_rb(src, w * h, bpp);
-
     dxt_compress(dst, src, DDS_COMPRESS_BC1, w, h, bpp, mipmaps);
 }
 
 int dxt_compress(unsigned char *dst, unsigned char *src, int format,
                  unsigned int width, unsigned int height, int bpp,
                  int mipmaps) {
-    int internal = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+    CDxtCompressor compressor(DXT_NORMAL);
     int i, size, w, h;
     unsigned int offset;
     unsigned char *tmp;
-    unsigned char *s, c;
+    unsigned char *s;
 
     if (!(IS_POT(width) && IS_POT(height)))
         return(0);
@@ -80,13 +75,6 @@ int dxt_compress(unsigned char *dst, unsigned char *src, int format,
 
     generate_mipmaps_software(tmp, src, width, height, bpp, 0, mipmaps);
 
-    /* libtxc_dxtn wants BGRA pixels */
-    for (i = 0; i < size; i += bpp) {
-        c = tmp[i];
-        tmp[i] = tmp[i + 2];
-        tmp[i + 2] = c;
-    }
-
     offset = 0;
     w = width;
     h = height;
@@ -94,7 +82,7 @@ int dxt_compress(unsigned char *dst, unsigned char *src, int format,
 
     if (format <= DDS_COMPRESS_BC3N) {
         for (i = 0; i < mipmaps; ++i) {
-            compress_dxtn(bpp, w, h, s, internal, dst + offset);
+            compressor.CompressImage(s, w, h, dst + offset);
             s += (w * h * bpp);
             printf("get_mipmapped_size[%i] = %i\n",i,get_mipmapped_size(w, h, 0, 0, 1, format));
             offset += get_mipmapped_size(w, h, 0, 0, 1, format);
@@ -108,17 +96,6 @@ int dxt_compress(unsigned char *dst, unsigned char *src, int format,
     return(1);
 }
 
-static void swap_rb(unsigned char *pixels, unsigned int n, int bpp) {
-    unsigned int  i;
-    unsigned char t;
-
-    for (i = 0; i < n; ++i) {
-        t = pixels[bpp * i + 0];
-        pixels[bpp * i + 0] = pixels[bpp * i + 2];
-        pixels[bpp * i + 2] = t;
-    }
-}
-
 int generate_mipmaps_software(unsigned char *dst, unsigned char *src,
                               unsigned int width, unsigned int height,
                               int bpp, int indexed, int mipmaps) {
@@ -327,34 +304,55 @@ bool compress_one(const char * in_filename) {
     return true;
 }
 
-int main(int argc, char **argv) {
+/*
+ * Stream mode for mapconv --stream, see CompressorPipe.h for the protocol.
+ * Images are read from stdin and the compressed mipmaps written to stdout
+ * until stdin is closed, the messages of the compressor go to stderr.
+ */
+int compress_stream() {
+    FILE *out = fdopen(dup(fileno(stdout)), "wb");
+    dup2(fileno(stderr), fileno(stdout));
+
+    int header[3];
+    while (fread(header, sizeof(header), 1, stdin) == 1) {
+        int w = header[0];
+        int h = header[1];
+        int mipmaps = header[2];
+        if (w < 1 || h < 1 || !(IS_POT(w) && IS_POT(h)) ||
+            mipmaps < 1 || mipmaps > get_num_mipmaps(w, h)) {
+            fprintf(stderr, "ERROR, bad image %i x %i with %i mipmaps\n", w, h, mipmaps);
+            return 1;
+        }
 
-    if (argc < 2) {
-        printf("Usage: %s image.png\n", argv[0]);
-        return 1;
+        unsigned char *src = new unsigned char[w * h * 4];
+        if (fread(src, w * h * 4, 1, stdin) != 1) {
+            delete[] src;
+            return 1;
+        }
+        int size = get_mipmapped_size(w, h, 4, 0, mipmaps, DDS_COMPRESS_BC1);
+        unsigned char *dst = new unsigned char[size];
+        compressed_rgba_s3tc_dxt1_ext_software(mipmaps, src, w, h, dst);
+
+        fwrite(&size, sizeof(size), 1, out);
+        fwrite(dst, size, 1, out);
+        fflush(out);
+        delete[] src;
+        delete[] dst;
     }
+    fclose(out);
+    return 0;
+}
 
-    /*
-     * Load the shared library for dxt compression
-     */
+int main(int argc, char **argv) {
 
-    hdxtn = dlopen(DXTN_DLL, RTLD_LAZY | RTLD_GLOBAL);
-    if (hdxtn == NULL) {
-        printf("Unable to load library %s\n", DXTN_DLL);
-        printf("If the library libtxc isn't installed. DO THIS NOW ;-)\n");
-        printf("Maybe you find it here: http://homepage.hispeed.ch/rscheidegger/dri_experimental/libtxc_dxtn060508.tar.gz\n");
-        printf("try to set: the LD_LIBRARY_PATH to the directory containing libtxc_dxtn.so\n example: \"export LD_LIBRARY_PATH=directory_containing_lib/\"\n");
+    if (argc < 2) {
+        printf("Usage: %s image.png ...\n", argv[0]);
+        printf("       %s --stream\n", argv[0]);
         return 1;
     }
-    printf("Library %s found and loaded with success\n", DXTN_DLL);
 
-    compress_dxtn = (void (*)(int, int, int, const unsigned char*, int, unsigned char*))dlsym(hdxtn, "tx_compress_dxtn");
-
-    if (compress_dxtn == NULL) {
-        dlclose(hdxtn);
-        printf("Missing symbol `tx_compress_dxtn' in %s\n", DXTN_DLL);
-        return 1;
-    }
+    if (strcmp(argv[1], "--stream") == 0)
+        return compress_stream();
 
     /*
      * For each file on the command line, make a converted version of it.
@@ -35,23 +35,16 @@
 
 #define IS_POT(x)      (!((x) & ((x) - 1)))
 #include <stdlib.h>
-
-#include <GL/gl.h>
-#include <dlfcn.h>
+#include <stdio.h>
 
 #include <string.h>
 #include <math.h>
-
-void *hdxtn = NULL;
-#define DXTN_DLL "libtxc_dxtn.so"
-
-static void (*compress_dxtn)(int, int, int, const unsigned char*, int, unsigned char *) = NULL;
+#include <unistd.h>
 
 void compressed_rgba_s3tc_dxt1_ext_software(int mipmaps,unsigned char *src, int w, int h, unsigned char *dst);
 int dxt_compress(unsigned char *dst, unsigned char *src, int format,
                  unsigned int width, unsigned int height, int bpp,
                  int mipmaps);
-static void swap_rb(unsigned char *pixels, unsigned int n, int bpp);
 int generate_mipmaps_software(unsigned char *dst, unsigned char *src,
                               unsigned int width, unsigned int height,
                               int bpp, int indexed, int mipmaps);
@@ -63,6 +56,7 @@ unsigned int get_mipmapped_size(int width, int height, int bpp,
                                 int level, int num, int format);
 int get_num_mipmaps(int width, int height);
 bool compress_one(const char * in_filename);
+int compress_stream();
 
 
 